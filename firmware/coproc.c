@@ -0,0 +1,256 @@
+/*
+
+	Reference coprocessor firmware: executes command batches from the host (remote.c) on the LPC bus,
+	using the same cycle code as the host tool (lpc.c). See remote_proto.h for the protocol.
+	Board support has to provide:
+	- linkGetc(): blocking read of one byte from the serial port;
+	- linkWrite(): write a buffer to the serial port;
+	- usleep() (e.g. on top of delayMicroseconds());
+	- a GpioBackend, assigned to `lpcGpio` before coprocMain() is called (Arduino pinMode/digitalWrite/digitalRead
+	  map onto it one-to-one and can't fail, see gpio_wiringpi.c).
+
+*/
+
+#include "../lpc.h"
+#include "../remote_proto.h"
+
+int linkGetc(void);
+void linkWrite(const unsigned char* data, unsigned int len);
+
+static unsigned char rx[LINK_MAX_FRAME];
+static unsigned char tx[LINK_MAX_FRAME];
+static unsigned int txLen;
+static unsigned char expectedSeq = 0;
+static bool nakSent = false; //One NAK per rejected batch, the host resends everything after it anyway
+static bool skipping = false; //A command failed, everything is skipped until CMD_RESUME
+
+static unsigned char scsCount[2];
+static unsigned long scsAddr[2][SCS_MAX_CYCLES];
+static unsigned char scsData[2][SCS_MAX_CYCLES];
+
+static unsigned long get32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static unsigned int get16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void sendFrame(unsigned char seq, unsigned char type, unsigned int payloadLen)
+{
+	tx[0] = LINK_SOF;
+	tx[1] = seq;
+	tx[2] = type;
+	tx[3] = payloadLen & 0xFF;
+	tx[4] = payloadLen >> 8;
+	uint16_t crc = linkCrc(0xFFFF, tx + 1, LINK_HEADER_LEN - 1 + payloadLen);
+	tx[LINK_HEADER_LEN + payloadLen] = crc & 0xFF;
+	tx[LINK_HEADER_LEN + payloadLen + 1] = crc >> 8;
+	linkWrite(tx, LINK_HEADER_LEN + payloadLen + LINK_CRC_LEN);
+}
+
+static void reject(void)
+{
+	if (nakSent) return;
+	nakSent = true;
+	sendFrame(expectedSeq, LINK_NAK, 0);
+}
+
+//Returns payload length of a valid, in-sequence batch, or -1
+static int receiveBatch(void)
+{
+	unsigned int len, i;
+	while (linkGetc() != LINK_SOF);
+	for (i = 1; i < LINK_HEADER_LEN; i++) rx[i] = linkGetc();
+	len = get16(rx + 3);
+	if (len > LINK_MAX_PAYLOAD)
+	{
+		reject();
+		return -1;
+	}
+	for (i = 0; i < len + LINK_CRC_LEN; i++) rx[LINK_HEADER_LEN + i] = linkGetc();
+	uint16_t crc = linkCrc(0xFFFF, rx + 1, LINK_HEADER_LEN - 1 + len);
+	if ((get16(rx + LINK_HEADER_LEN + len) == crc) && (rx[2] == LINK_SYNC))
+	{
+		//New session
+		expectedSeq = rx[1];
+		nakSent = false;
+		skipping = false;
+		sendFrame(expectedSeq, LINK_SYNC, 0);
+		return -1;
+	}
+	if ((get16(rx + LINK_HEADER_LEN + len) != crc) || (rx[2] != LINK_BATCH) || (rx[1] != expectedSeq))
+	{
+		reject();
+		return -1;
+	}
+	nakSent = false;
+	return len;
+}
+
+static unsigned char runSCS(unsigned char kind)
+{
+	for (unsigned char i = 0; i < scsCount[kind]; i++)
+	{
+		if (lpcWriteCycle(&(scsData[kind][i]), scsAddr[kind][i], 1) != LPC_OK) return ST_BUS;
+	}
+	return ST_OK;
+}
+
+static unsigned char pollByte(unsigned long addr, unsigned char expected, unsigned char* value)
+{
+	switch (lpcDataPoll(addr, expected, value, POLL_LIMIT))
+	{
+		case LPC_OK: return (*value == expected) ? ST_OK : ST_VERIFY;
+		case LPC_ERR_TIMEOUT: return ST_TIMEOUT;
+		default: return ST_BUS;
+	}
+}
+
+static unsigned char programByte(unsigned long addr, unsigned char data)
+{
+	unsigned char value, st = runSCS(SCS_KIND_PROGRAM);
+	if (st != ST_OK) return st;
+	if (lpcWriteCycle(&data, addr, 1) != LPC_OK) return ST_BUS;
+	if (scsCount[SCS_KIND_PROGRAM] == 0) return ST_OK; //Plain write, nothing to poll
+	return pollByte(addr, data, &value);
+}
+
+static void putResult(unsigned char v)
+{
+	tx[LINK_HEADER_LEN + txLen++] = v;
+}
+
+//Puts ST_SKIPPED and the padding in place of the results if an earlier command failed
+static bool skipped(unsigned int padding)
+{
+	if (!skipping) return false;
+	putResult(ST_SKIPPED);
+	while (padding--) putResult(0);
+	return true;
+}
+
+//Bus failures stop everything after them
+static unsigned char track(unsigned char st)
+{
+	if (st != ST_OK) skipping = true;
+	return st;
+}
+
+//Executes commands until the end of the payload or a malformed command
+static void executeBatch(unsigned int len)
+{
+	const unsigned char* p = rx + LINK_HEADER_LEN;
+	const unsigned char* end = p + len;
+	unsigned char st, value;
+	unsigned int i, n;
+	txLen = 0;
+	while (p < end)
+	{
+		unsigned char op = *p++;
+		switch (op)
+		{
+			case CMD_READ:
+				if (end - p < 7) goto bad;
+				n = get16(p + 4);
+				if ((lpcReadMSize(p[6]) == MSIZE_INVALID) || (n % p[6] != 0) || (txLen + 1 + n > LINK_MAX_PAYLOAD)) goto bad;
+				if (!skipped(n))
+				{
+					putResult(ST_OK);
+					st = ST_OK;
+					for (i = 0; i < n; i += p[6])
+					{
+						if (lpcReadCycle(tx + LINK_HEADER_LEN + txLen + i, get32(p) + i, p[6]) > LPC_WARN_TAR) st = ST_BUS;
+					}
+					tx[LINK_HEADER_LEN + txLen - 1] = track(st);
+					txLen += n;
+				}
+				p += 7;
+				break;
+			case CMD_WRITE:
+				if (end - p < 5) goto bad;
+				if (!skipped(0)) putResult(track((lpcWriteCycle(p + 4, get32(p), 1) == LPC_OK) ? ST_OK : ST_BUS));
+				p += 5;
+				break;
+			case CMD_PROGRAM:
+				if (end - p < 6) goto bad;
+				n = get16(p + 4);
+				if (end - p < 6 + (long)n) goto bad;
+				if (!skipped(2))
+				{
+					st = ST_OK;
+					lpcEnableWrite(true);
+					for (i = 0; (i < n) && (st == ST_OK); i++) st = programByte(get32(p) + i, p[6 + i]);
+					lpcEnableWrite(false);
+					putResult(track(st));
+					if (st != ST_OK) i--;
+					putResult(i & 0xFF);
+					putResult(i >> 8);
+				}
+				p += 6 + n;
+				break;
+			case CMD_ERASE:
+				if (end - p < 5) goto bad;
+				if (!skipped(0))
+				{
+					lpcEnableWrite(true);
+					st = runSCS(SCS_KIND_ERASE);
+					if ((st == ST_OK) && (lpcWriteCycle(p + 4, get32(p), 1) != LPC_OK)) st = ST_BUS;
+					if (st == ST_OK) st = pollByte(get32(p), 0xFF, &value);
+					lpcEnableWrite(false);
+					putResult(track(st));
+				}
+				p += 5;
+				break;
+			case CMD_POLL:
+				if (end - p < 5) goto bad;
+				if (!skipped(1))
+				{
+					value = 0;
+					putResult(track(pollByte(get32(p), p[4], &value)));
+					putResult(value);
+				}
+				p += 5;
+				break;
+			case CMD_SET_SCS:
+				if ((end - p < 2) || (p[0] > SCS_KIND_ERASE) || (p[1] > SCS_MAX_CYCLES) || (end - p < 2 + 5 * p[1])) goto bad;
+				if (skipped(0))
+				{
+					p += 2 + 5 * p[1];
+					break;
+				}
+				scsCount[p[0]] = p[1];
+				for (i = 0; i < p[1]; i++)
+				{
+					scsAddr[p[0]][i] = get32(p + 2 + 5 * i);
+					scsData[p[0]][i] = p[2 + 5 * i + 4];
+				}
+				putResult(ST_OK);
+				p += 2 + 5 * p[1];
+				break;
+			case CMD_RESUME:
+				skipping = false;
+				putResult(ST_OK);
+				break;
+			default:
+				goto bad;
+		}
+	}
+	return;
+bad:
+	putResult(ST_BAD_CMD);
+}
+
+void coprocMain(void)
+{
+	lpcPreparePins();
+	for (;;)
+	{
+		int len = receiveBatch();
+		if (len < 0) continue;
+		executeBatch(len);
+		sendFrame(expectedSeq++, LINK_RESULT, txLen);
+	}
+}
@@ -12,566 +12,451 @@
 
 #include "flasher.h"
 
-void dbgPause(void)
+void traceStart(void)
 {
-	if (dbg)
+	lpcTrace = malloc(TRACE_RING_LEN * sizeof(TraceEntry));
+	if (lpcTrace == NULL)
 	{
-		printf("Press any key to continue...\n");
-		getchar();
+		printf("Can not allocate bus trace buffer!\n");
+		exit(1);
 	}
+	lpcTraceHead = 0;
+	clock_gettime(CLOCK_MONOTONIC, &traceStartTime);
+	traceStartTicks = traceTicks();
 }
 
-void dbgPrint(char* str)
+//Ring contents go out oldest first, so the decoder doesn't have to know about wrapping.
+void traceDump(void)
 {
-	if (dbg)
+	struct timespec now;
+	uint64_t ticks = traceTicks();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - traceStartTime.tv_sec) + (now.tv_nsec - traceStartTime.tv_nsec) / 1e9;
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, (seconds > 0) ? ((ticks - traceStartTicks) / seconds) : 1e9, 0, 0 };
+	uint32_t first = 0;
+	if (lpcTraceHead > TRACE_RING_LEN)
 	{
-		printf(str);
-		printf("\n");
+		header.Count = TRACE_RING_LEN;
+		header.Dropped = (lpcTraceHead - TRACE_RING_LEN > UINT32_MAX) ? UINT32_MAX : (lpcTraceHead - TRACE_RING_LEN);
+		first = lpcTraceHead & (TRACE_RING_LEN - 1);
 	}
+	else
+	{
+		header.Count = lpcTraceHead;
+	}
+	FILE* f = fopen(traceFileName, "wb");
+	if (f == NULL)
+	{
+		printf("Can not open trace file %s!\n", traceFileName);
+		return;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&lpcTrace[first], sizeof(TraceEntry), header.Count - first, f);
+	fwrite(lpcTrace, sizeof(TraceEntry), first, f);
+	fclose(f);
+	printf("Bus trace: %u nibbles written to %s.\n", header.Count, traceFileName);
 }
 
 //Convention: code 0 is OK, code 1 is ERROR, code 2 is Bad Input
 void safeExit(int code)
 {
-	digitalWrite(rstPin, LOW);
-	pinMode(rstPin, OUTPUT);
-	enableWrite(false);
-	setLADInputZ(true);
-	pinMode(wrPin, INPUT);
-	pinMode(lframePin, INPUT);
-	pinMode(lclkPin, INPUT);
-	if (fileHandle != -1) close(fileHandle);
+	if (lpcTrace != NULL)
+	{
+		traceDump();
+		free(lpcTrace);
+		lpcTrace = NULL;
+	}
+	fwhClose(bus);
+	bus = NULL;
+	if (gzHandle != NULL) gzclose(gzHandle); //Also closes fileHandle
+	else if (fileHandle != -1) close(fileHandle);
 	exit(code);
 }
 
-
-void setLADOutputZ(bool zeroOut) {
-	if (zeroOut)
-	{
-		digitalWrite(lad0Pin, LOW);
-		digitalWrite(lad1Pin, LOW);
-		digitalWrite(lad2Pin, LOW);
-		digitalWrite(lad3Pin, LOW);
-		dbgPrint("LAD GPIO zeroed out.");
-	}
-	pinMode(lad0Pin, OUTPUT);
-	pinMode(lad1Pin, OUTPUT);
-	pinMode(lad2Pin, OUTPUT);
-	pinMode(lad3Pin, OUTPUT);
-	dbgPrint("LAD GPIO switched to OUTput.");
-	dbgPause();
-}
-
-void setLADOutput(void)
+void check(FwhError ret)
 {
-	setLADOutputZ(false);
-}
-
-void setLADInputZ(bool zeroOut) {
-	pinMode(lad0Pin, INPUT);
-	pinMode(lad1Pin, INPUT);
-	pinMode(lad2Pin, INPUT);
-	pinMode(lad3Pin, INPUT);
-	dbgPrint("LAD GPIO switched to INput.");
-	if (zeroOut)
-	{
-		digitalWrite(lad0Pin, LOW);
-		digitalWrite(lad1Pin, LOW);
-		digitalWrite(lad2Pin, LOW);
-		digitalWrite(lad3Pin, LOW);
-		dbgPrint("LAD GPIO zeroed out.");
-	}
-	dbgPause();
+	if (ret == FWH_OK) return;
+	safeExit((ret == FWH_ERR_BAD_ARG) ? 2 : 1);
 }
 
-void setLADInput(void)
+void endProgress(void)
 {
-	setLADInputZ(false);
-}
-
-
-void writeLAD(unsigned char data, unsigned char startFrame) {
-	//Data is latched on rising edge (clock has to be PCI-compliant). Timings should be well in-spec:
-	//LCLK minimum half-period is 11ns, while RPi is only capable of ~100nS minimum pulse width with wiringPi)
-	//Therefore I really don't understand why LCLK is driven high before the actual writing to LAD[3:0]
-	//But changing the order results in garbage being received (data stream gets shifted by a nibble and is misinterpreted).
-	digitalWrite(lclkPin, HIGH);
-	if (dbg) printf("Previous (?) LAD+LFRAME written, CLK high. Writing new (?) value: 0x%hhx", data);
-	dbgPause();
-	if(data & 0x1) {
-		digitalWrite(lad0Pin, HIGH);
-	} else {
-		digitalWrite(lad0Pin, LOW);
-	}
-	if(data & 0x2) {
-		digitalWrite(lad1Pin, HIGH);
-	} else {
-		digitalWrite(lad1Pin, LOW);
-	}
-	if(data & 0x4) {
-		digitalWrite(lad2Pin, HIGH);
-	} else {
-		digitalWrite(lad2Pin, LOW);
-	}
-	if(data & 0x8) {
-		digitalWrite(lad3Pin, HIGH);
-	} else {
-		digitalWrite(lad3Pin, LOW);
-	}
-	if (startFrame) {
-		digitalWrite(lframePin, LOW);
-	}
-	else {
-		digitalWrite(lframePin, HIGH);
-	}
-	//My setup uses a breadboard and some long-ish wires, therefore I've uncommented all delays.
-	usleep(100);
-	digitalWrite(lclkPin, LOW);
-	usleep(100);
+	if (!progressShown) return;
+	printf("\n");
+	progressShown = false;
 }
 
-unsigned char readLAD(void) {
-	unsigned char data;
-	usleep(100);
-	digitalWrite(lclkPin, HIGH);
-	dbgPrint("Reading data: clock is high.");
-	dbgPause();
-	usleep(100);
-	data = 0;
-	if(digitalRead(lad0Pin)) data |= 0x01;
-	if(digitalRead(lad1Pin)) data |= 0x02;
-	if(digitalRead(lad2Pin)) data |= 0x04;
-	if(digitalRead(lad3Pin)) data |= 0x08;
-	if (dbg)
-	{
-		printf("Read nibble: 0x%hhx\n", data);
-	}
-	digitalWrite(lclkPin, LOW);
-	return data;
+void logMessage(FwhLogLevel level, const char* text, void* ctx)
+{
+	(void)ctx;
+	endProgress();
+	printf((level == FWH_LOG_ERROR) ? "%s!\n" : "%s\n", text);
+	if (level == FWH_LOG_STEP) getchar(); //Debug mode (-d): every bus step waits for a key
 }
 
-void enableWrite(bool value)
+void showProgress(FwhOp op, unsigned long addr, unsigned long done, unsigned long total, void* ctx)
 {
-	if (value)
+	(void)ctx;
+	if (op != FWH_OP_READ)
+	{
+		printf("%08lx\r", addr);
+	}
+	else if (fileHandle != -1)
 	{
-		digitalWrite(wrPin, LOW);
+		//Useful for large reads that are usually saved into a file (short ones are displayed when done)
+		printf("\r%2d%%", (int)((100 * done) / total));
 	}
 	else
 	{
-		digitalWrite(wrPin, HIGH);
+		return;
 	}
+	progressShown = true;
 }
 
-void preparePinMode(void) {
-	digitalWrite(rstPin, LOW);
-	digitalWrite(lclkPin, LOW);
-	digitalWrite(lframePin, HIGH);
-	enableWrite(false);
-	digitalWrite(lad0Pin, LOW);
-	digitalWrite(lad1Pin, LOW);
-	digitalWrite(lad2Pin, LOW);
-	digitalWrite(lad3Pin, LOW);
-	dbgPrint("preparePinMode phase 1");
-	dbgPause();
-	setLADInput();
-	pinMode(rstPin, OUTPUT);
-	pinMode(wrPin, OUTPUT);
-	pinMode(lframePin, OUTPUT);
-	pinMode(lclkPin, OUTPUT);
-	dbgPrint("preparePinMode phase 2");
-	dbgPause();
-	usleep(2000);
-	digitalWrite(rstPin, HIGH);
-	usleep(1000);
-	dbgPrint("preparePinMode finished. Reset is high.");
-	dbgPause();
-}
-
-//According to SST49LF016C datasheet
-unsigned int len2mSizeRead(unsigned int len) {
-	switch(len) {
-		case 1: return 0;
-		case 2: return 1;
-		case 4: return 2;
-		case 16: return 4;
-		case 128: return 7;
-		default: 
-			printf("Bad block length specified!\n");
-			safeExit(2);
+unsigned char* allocImage(unsigned long length)
+{
+	unsigned char* image = malloc(length);
+	if (image == NULL)
+	{
+		printf("Out of memory!\n");
+		safeExit(1);
 	}
+	return image;
 }
 
-//According to SST49LF016C datasheet
-unsigned int len2mSizeWrite(unsigned int len) {
-	switch(len) {
-		case 1: return 0;
-		case 2: return 1;
-		case 4: return 2;
-		default: 
-			printf("Bad block length specified!\n");
+//The whole extent is prefetched from the file, so programming never waits for the disk
+void loadImage(unsigned char* image, unsigned long seek, unsigned long length)
+{
+	ssize_t readLen;
+	unsigned long done = 0;
+	while (done < length)
+	{
+		readLen = pread(fileHandle, image + done, length - done, seek + done);
+		if (readLen <= 0)
+		{
+			printf("Unexpected end of file!\n");
 			safeExit(2);
+		}
+		done += readLen;
 	}
 }
 
-//Should be suitable for all FWH chips now.
-bool readCycle(unsigned char *buffer, unsigned long startAddr, unsigned int len) {
-	bool ret = false; //Returns true if generates a warning
-	dbgPrint("Read cycle begins.");
-	unsigned int addr;
-	setLADOutput();
-	dbgPrint("Write start nibble.");
-	writeLAD(0x0d, 1); //Start mem read
-	dbgPrint("Write IDSEL.");
-	writeLAD(0x0, 0); //IDSEL=0000 (internally pulled low)
-	//7 Addr cycles
-	dbgPrint("Write address (7 nibbles).");
-	writeLAD((startAddr >> 24) & 0xF, 0);
-	writeLAD((startAddr >> 20) & 0xF, 0);
-	writeLAD((startAddr >> 16) & 0xF, 0);
-	writeLAD((startAddr >> 12) & 0xF, 0);
-	writeLAD((startAddr >> 8) & 0xF, 0);
-	writeLAD((startAddr >> 4) & 0xF, 0);
-	writeLAD((startAddr >> 0) & 0xF, 0);
-	//MSIZE, 49lf004b and similar ones only support single-byte mode (0000).
-	dbgPrint("Write MSIZE.");
-	writeLAD(len2mSizeRead(len), 0);
-	//TAR0 "turnaround cycle" start (1111)
-	dbgPrint("Start turnaround cycle.");
-	writeLAD(0xF, 0);
-	setLADInputZ(true); //No clock here
-	//TAR1: Float to 1111: do not sample
-	usleep(100);
-	dbgPrint("Not a read: clock pulse for TAR1 float-to-1111 transition.");
-	readLAD();
-	usleep(100);
-	//RSYNC
-	dbgPrint("Reading RSYNC...");
-	unsigned char d = readLAD();
-	if(d != 0) {
-		printf("RSYNC not zero: %01x\n", d);
-		if (!dbg) safeExit(1);
-	}
-	//DATA fetching
-	addr = 0;
-	for(addr = 0; addr < len; addr++) {
-		if (dbg) printf("Byte %u:\n", addr);
-		dbgPrint("Reading lower nibble...");
-		d = readLAD();
-		dbgPrint("Reading higher nibble...");
-		d |= readLAD() << 4;
-		buffer[addr] = d;
-	}
-	dbgPrint("Reading TAR0...");
-	if((d = readLAD()) != 0xF) {
-		printf("\nTAR0 not all ones: %01x\n", d); //\n is a workaround for progress display (see main)
-		ret = true;
-		//exit(1); This is not critical, the chip holds the bus high only for 28nS, if I'm not mistaken.
-		//The value we read here is going to depend on stray capacitance and pin impedance.
-	}
-	//TAR1 - regain control over the bus.
-	dbgPrint("Not a read: clock pulse for TAR1 (regaining control)...");
-	readLAD();
-	return ret;
-}
+//Dump output is staged in memory and written in DUMP_BUF_LEN chunks, that saves a syscall per block.
+unsigned char dumpBuffer[DUMP_BUF_LEN];
+unsigned int dumpFill = 0;
+off_t dumpOffset = 0; //File offset of dumpBuffer[0]
+off_t dumpInitialSize = 0; //Files are not truncated on open, old contents have to be punched out
+off_t dumpEnd = 0; //Furthest offset written (job files may write regions out of order)
 
-//Should be suitable for all FWH chips now.
-void writeCycle(unsigned char *buffer, unsigned long startAddr, unsigned int len) {
-	unsigned int addr;
-	unsigned char d;
-	setLADOutput();
-	writeLAD(0x0e, 1);
-	writeLAD(0x0, 0); //IDSEL=0000 (internally pulled low)
-	//7 Addr cycles
-	writeLAD((startAddr >> 24) & 0xF, 0);
-	writeLAD((startAddr >> 20) & 0xF, 0);
-	writeLAD((startAddr >> 16) & 0xF, 0);
-	writeLAD((startAddr >> 12) & 0xF, 0);
-	writeLAD((startAddr >> 8) & 0xF, 0);
-	writeLAD((startAddr >> 4) & 0xF, 0);
-	writeLAD((startAddr >> 0) & 0xF, 0);
-	//MSIZE
-	writeLAD(len2mSizeWrite(len), 0);
-	//Data
-	for(addr = 0; addr < len; addr++) {
-		writeLAD(buffer[addr] & 0xF , 0);
-		writeLAD((buffer[addr] >> 4) & 0xF , 0);
-	}
-	//TAR0
-	writeLAD(0xF, 0);
-	setLADInput();
-	usleep(1000);
-	//TAR1
-	readLAD();
-	//RSYNC
-	if(readLAD() != 0) {
-		printf("RSYNC not zero!\n");
-		safeExit(1);
-	}
-	//TAR0
-	if((d = readLAD()) != 0xF) {
-		printf("TAR0 not all ones during a write cycle: 0x%hhx!\n", d);
-		safeExit(1);
+bool isZeroBlock(unsigned char* buffer, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++)
+	{
+		if (buffer[i] != 0) return false;
 	}
-	//TAR1
-	readLAD();
+	return true;
 }
 
-unsigned char readStatusRegister() {
-	unsigned char buffer[1];
-	buffer[0] = 0x70;
-	writeCycle(buffer, 0x0ffc0000, 1);
-	readCycle(buffer, 0x0ffc0000, 1);
-	return buffer[0];
+void dumpOpen(void)
+{
+	struct stat st;
+	if (dumpMode == DUMP_GZIP)
+	{
+		gzHandle = gzdopen(fileHandle, "wb");
+		if (gzHandle == NULL)
+		{
+			printf("Can not open gzip stream!\n");
+			safeExit(1);
+		}
+		return;
+	}
+	if (fstat(fileHandle, &st) == 0) dumpInitialSize = st.st_size;
 }
 
-void waitForWriteComplete() {
-	while((readStatusRegister() & 0x01) == 0x01) {
-		usleep(10);
+void dumpFlush(void)
+{
+	unsigned int i, n;
+	if (dumpMode == DUMP_GZIP)
+	{
+		if (dumpFill > 0 && gzwrite(gzHandle, dumpBuffer, dumpFill) != (int)dumpFill)
+		{
+			printf("\nCan not write to the gzip stream!\n");
+			safeExit(1);
+		}
+		dumpFill = 0;
+		return;
 	}
+	for (i = 0; i < dumpFill; i += n)
+	{
+		n = dumpFill - i;
+		if (n > DUMP_HOLE_LEN) n = DUMP_HOLE_LEN;
+		if ((dumpMode == DUMP_SPARSE) && isZeroBlock(dumpBuffer + i, n))
+		{
+			//Holes read back as zeros. Beyond the old EOF there is nothing to do, the final ftruncate() creates them.
+			if (dumpOffset + i >= dumpInitialSize) continue;
+			if (fallocate(fileHandle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, dumpOffset + i, n) == 0) continue;
+			//Filesystem doesn't support holes (FAT SD card, old NFS): fall back to writing the zeros
+		}
+		if (pwrite(fileHandle, dumpBuffer + i, n, dumpOffset + i) != (ssize_t)n)
+		{
+			printf("\nCan not write to the output file!\n");
+			safeExit(1);
+		}
+	}
+	dumpOffset += dumpFill;
+	dumpFill = 0;
+	if (dumpOffset > dumpEnd) dumpEnd = dumpOffset;
 }
 
-void readIDs(unsigned char* ret)
+//Not supported by the gzip stream
+void dumpSeek(off_t offset)
 {
-	unsigned char buffer[3];
-	printf("Reading manufacturer ID...\n");
-	readCycle(buffer, 0xFFBC0000, 1); //From SST49LF004B datasheet. JEDEC-defined registers should be the same for all FWH chips.
-	printf("Manufacturer ID: 0x%hhx\n", buffer[0]);
-	ret[0] = buffer[0];
-	printf("Reading chip ID...\n");
-	readCycle(buffer, 0xFFBC0001, 1);
-	printf("Chip ID: 0x%hhx\n", buffer[0]);
-	ret[1] = buffer[0];
+	dumpFlush();
+	dumpOffset = offset;
 }
 
-void eraseChip(void)
+void dumpWrite(unsigned char* buffer, unsigned int len)
 {
-	/*
-	buffer[0] = 0;
-	for(addr = 0x0fa00002; addr <= 0x0fbf0002; addr += 0x00010000) {
-	writeCycle(buffer, addr, 1);
-	};
-	writeCycle(buffer, 0x0fbf8002, 1); - these Software Commands are not implemented in 49lf004b
-	writeCycle(buffer, 0x0fbfa002, 1);
-	writeCycle(buffer, 0x0fbfc002, 1);
-	if(erase) {
-	for(addr = start; addr < start + length; addr += 0x1000) {
-	printf("Erasing sector %lx\n", addr);
-	buffer[0] = 0x30;
-	writeCycle(buffer, addr, 1);
-	buffer[0] = 0xd0;
-	writeCycle(buffer, addr, 1);
-	usleep(50000);
-	}
-	addr = 0x5ff980;
-	if(start + length > addr) {
-	printf("Erasing sector %lx\n", addr);
-	buffer[0] = 0x30;
-	writeCycle(buffer, addr, 1);
-	buffer[0] = 0xd0;
-	writeCycle(buffer, addr, 1);
-	usleep(50000);
-	}
-	}*/
+	if (dumpFill + len > DUMP_BUF_LEN) dumpFlush();
+	memcpy(dumpBuffer + dumpFill, buffer, len);
+	dumpFill += len;
 }
 
-void flashChip(void)
+void dumpClose(void)
 {
-	/*
-	printf("Writing\n");
-	if((lseek(fileHandle, 0, SEEK_END)) % len != 0) {
-	printf("File size is not multiple of block length\n");
-	exit(1);
-	}
-	lseek(fileHandle, seek, SEEK_SET);
-	for(addr = start; addr < start+length; addr += len) {
-	printf("%08lx\r", addr);
-	buffer[0] = cmdW;
-	writeCycle(buffer, 0x0ffc0000, 1); - these Software Commands are not implemented in 49lf004b
-	readLen = read(fileHandle, buffer, len);
-	if(readLen != len) {
-	printf("Not whole block was read\n");
-	exit(1);
-	}
-	if(readLen == 0) {
-	printf("Unexpected end of file");
-	exit(1);
-	}
-	writeCycle(buffer, addr, readLen);
-	waitForWriteComplete();
+	dumpFlush();
+	if (dumpMode == DUMP_GZIP)
+	{
+		if (gzclose(gzHandle) != Z_OK) printf("Can not finalize the gzip stream!\n");
+		gzHandle = NULL;
+		fileHandle = -1;
+		return;
 	}
-	printf("\n");
-	usleep(1000);
-	*/
+	//Trailing hole
+	if ((dumpMode == DUMP_SPARSE) && (dumpEnd > dumpInitialSize)) ftruncate(fileHandle, dumpEnd);
 }
 
-void verifyChip(unsigned long seek, unsigned long start, unsigned long length, unsigned int len,
-	unsigned char* buffer, unsigned char* buffer2)
+void printBlock(const unsigned char* buffer, unsigned int len)
 {
-	unsigned long addr, end = start + length;
-	unsigned int readLen;
-	//buffer[0] = cmdR; - these Software Commands are not implemented in 49lf004b
-	//writeCycle(buffer, 0x0ffc0000, 1);
-	printf("Verifying...\n");
-	if (fileHandle != -1) {
-		lseek(fileHandle, seek, SEEK_SET);
-		for (addr = start; addr < end; addr += len) {
-			readCycle(buffer, addr | FLASH_SELECT_ADDR, len);
-			printf("%08lx\r", addr);
-			readLen = read(fileHandle, buffer2, len);
-			if (readLen != len)
-			{
-				printf("Read wrong block size from the file: expected = %u; read = %u.", len, readLen);
-			}
-			if (memcmp(buffer, buffer2, len) != 0) {
-				for (unsigned int i = 0; i < len; i++) {
-					if (buffer[i] != buffer2[i]) {
-						printf("Verify error at address %08lx R:%02x F:%02x\n", addr + i, buffer[i], buffer2[i]);
-					}
-				}
-				safeExit(1);
-			}
+	unsigned int i;
+	for (i = 0; i < len; i++) {
+		printf("%02x ", buffer[i]);
+	}
+	for (i = 0; i < len; i++) {
+		if (buffer[i] >= 32 && buffer[i]<127) {
+			printf("%c", buffer[i]);
+		}
+		else {
+			printf(".");
 		}
 	}
+	printf("\n");
 }
 
-void readChip(unsigned long start, unsigned long length, unsigned int len, unsigned char* buffer)
+//Saves (or displays) what has been read
+void saveRead(unsigned long start, unsigned long length, unsigned int len, const unsigned char* data)
 {
-	unsigned long addr, end;
-	//buffer[0] = cmdR; - these Software Commands are not implemented in 49lf004b
-	//writeCycle(buffer, 0x0ffc0000, 1);
-	printf("Reading...\n");
-	end = start + length;
-	for (addr = start; addr < end; addr += len) {
-		if (fileHandle != -1)
-		{
-			//Display progress indicator (useful for large reads that are usually saved into a file)
-			printf("\r%2d%%", (int)((100 * (addr - start)) / length));
-			//Returns true if it had printed a warning.
-			if (readCycle(buffer, addr | FLASH_SELECT_ADDR, len))
-			{
-				printf("The warning was generated at address 0x%lx\n", addr);
-			}
-			write(fileHandle, buffer, len);
-		}
-		else
-		{
-			//Display the contents in real time (useful for short reads)
-			printf("%08lx: ", addr);
-			readCycle(buffer, addr | FLASH_SELECT_ADDR, len); //Bit 22 directs reads to flash (not registers)
-			unsigned int i;
-			for (i = 0; i < len; i++) {
-				printf("%02x ", buffer[i]);
-			}
-			for (i = 0; i < len; i++) {
-				if (buffer[i] >= 32 && buffer[i]<127) {
-					printf("%c", buffer[i]);
-				}
-				else {
-					printf(".");
-				}
-			}
-			printf("\n");
+	unsigned long i;
+	if (fileHandle != -1)
+	{
+		for (i = 0; i < length; i += DUMP_BUF_LEN)
+		{
+			dumpWrite((unsigned char*)data + i, ((length - i) > DUMP_BUF_LEN) ? DUMP_BUF_LEN : (length - i));
 		}
+		return;
+	}
+	for (i = 0; i < length; i += len)
+	{
+		printf("%08lx: ", start + i);
+		printBlock(data + i, len);
 	}
-	printf("\n");
 }
 
-void compatibleEraseChip(unsigned long start, unsigned long length, unsigned int len, unsigned char* buffer)
+//Job ops map onto batch operations, which run in the same order as command line modes: read, erase, write, verify.
+int jobOp(char op)
 {
-	enableWrite(true);
-	unsigned long addr, end = length + start;
-	buffer[0] = 0;
-	printf("Writing zeros...\n");
-	for (addr = start; addr < end; addr += len)
-	{
-		printf("\r%2x%%", (int)((100 * (addr - start)) / length));
-		writeCycle(buffer, addr | FLASH_SELECT_ADDR, 1);
+	switch (op)
+	{
+		case 'r': return FWH_OP_READ;
+		case 'e': return FWH_OP_ERASE;
+		case 'w': return FWH_OP_PROGRAM;
+		case 'v': return FWH_OP_VERIFY;
+		default: return -1;
 	}
-	enableWrite(false);
-	printf("\n");
-	usleep(1000);
 }
 
-void compatibleFlashChip(unsigned long seek, unsigned long start, unsigned long length, unsigned int len, unsigned char* buffer)
+bool rangesOverlap(unsigned long a, unsigned long aLen, unsigned long b, unsigned long bLen)
 {
-	enableWrite(true);
-	unsigned long addr, end = length + start;
-	unsigned int readLen;
-	printf("Writing...\n");
-	if ((lseek(fileHandle, 0, SEEK_END)) % len != 0) {
-		printf("File size is not multiple of block size!\n");
+	return (a < b + bLen) && (b < a + aLen);
+}
+
+//Job file: one "<op> <start> <length> [file offset]" entry per line, op is one of r/e/w/v, numbers are hex.
+//Empty lines and lines starting with '#' are ignored.
+unsigned int loadJobs(const char* path, Job* jobs)
+{
+	char line[256];
+	unsigned int n = 0, lineNum = 0;
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+	{
+		printf("Can not open job file %s!\n", path);
 		safeExit(2);
 	}
-	lseek(fileHandle, seek, SEEK_SET);
-	for (addr = start; addr < end; addr += len) {
-		printf("%08lx\r", addr);
-		readLen = read(fileHandle, buffer, len);
-		if (readLen == 0) {
-			printf("Unexpected end of file!\n");
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char op;
+		int fields;
+		lineNum++;
+		if ((sscanf(line, " %c", &op) != 1) || (op == '#')) continue;
+		if (n == MAX_JOBS)
+		{
+			printf("Too many jobs, maximum is %u!\n", MAX_JOBS);
 			safeExit(2);
 		}
-		if (readLen != len) {
-			printf("Can not read block at 0x%lx from the file!\n", addr);
-			safeExit(1);
+		jobs[n].Seek = 0;
+		fields = sscanf(line, " %c %lx %lx %lx", &jobs[n].Op, &jobs[n].Start, &jobs[n].Length, &jobs[n].Seek);
+		if ((fields < 3) || (jobOp(jobs[n].Op) < 0) || (jobs[n].Length == 0))
+		{
+			printf("Bad job at line %u: %s", lineNum, line);
+			safeExit(2);
 		}
-		writeCycle(buffer, addr | FLASH_SELECT_ADDR, len);
+		jobs[n].Data = NULL;
+		n++;
 	}
-	enableWrite(false);
-	printf("\n");
-	usleep(1000);
+	fclose(f);
+	return n;
 }
 
-void executeSCS(const Device* dev, bool w)
+//Rejects jobs that would make the outcome depend on execution order
+void validateJobs(const Job* jobs, unsigned int n, unsigned int len)
 {
-	unsigned char buf[1];
-	if (w)
-	{
-		for (unsigned char i = 0; i < dev->WriteSCSCycles; i++)
-		{
-			*buf = dev->WriteCommand[i];
-			writeCycle(buf, dev->WriteAddress[i], 1);
-		}
+	bool bad = false;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		if ((jobs[i].Start % len != 0) || (jobs[i].Length % len != 0))
+		{
+			printf("Job %u: start and length have to be multiples of the block size!\n", i);
+			bad = true;
+		}
+		for (unsigned int j = i + 1; j < n; j++)
+		{
+			if ((jobs[i].Op == jobs[j].Op) && rangesOverlap(jobs[i].Start, jobs[i].Length, jobs[j].Start, jobs[j].Length))
+			{
+				printf("Jobs %u and %u overlap in chip address space!\n", i, j);
+				bad = true;
+			}
+			//Reads go into the file, so they must not clobber each other or the data that is going to be written/verified.
+			if (((jobs[i].Op == 'r') || (jobs[j].Op == 'r')) && (jobs[i].Op != 'e') && (jobs[j].Op != 'e')
+				&& rangesOverlap(jobs[i].Seek, jobs[i].Length, jobs[j].Seek, jobs[j].Length))
+			{
+				printf("Jobs %u and %u overlap in the file!\n", i, j);
+				bad = true;
+			}
+		}
 	}
-	else
-	{
-		for (unsigned char i = 0; i < dev->ReadSCSCycles; i++)
-		{
-			*buf = dev->ReadCommand[i];
-			writeCycle(buf, dev->ReadAddress[i], 1);
-		}
+	if (bad) safeExit(2);
+}
+
+void showLocks(void)
+{
+	const FwhDevice* dev;
+	const unsigned char* map;
+	unsigned int n;
+	check(fwhDetect(bus, &dev));
+	check(fwhReadLocks(bus, &map, &n));
+	if (n == 0)
+	{
+		printf("%s has no block locking registers.\n", dev->Name);
+		return;
+	}
+	printf("Block  Start     Locks\n");
+	for (unsigned int i = 0; i < n; i++)
+	{
+		printf("%-5u  %08lx  %s%s%s%s\n", i, i * dev->BlockSize, (map[i] & (FWH_LOCK_WRITE | FWH_LOCK_READ | FWH_LOCK_DOWN)) ? "" : "none",
+			(map[i] & FWH_LOCK_WRITE) ? "write " : "", (map[i] & FWH_LOCK_READ) ? "read " : "", (map[i] & FWH_LOCK_DOWN) ? "down" : "");
 	}
 }
 
-const Device* findDevice(unsigned char* ID)
+//Single batch for all jobs (or command line modes): the chip is identified once and the library plans the bus work.
+//The results table is shown for job files only.
+bool runJobs(Job* jobs, unsigned int n, unsigned int len, bool table)
 {
+	const FwhOperation* ops;
+	bool read = false;
 	unsigned int i;
-	for (i = 0; i < SUPPORTED_DEV_NUMBER; i++)
+	for (i = 0; i < n; i++)
 	{
-		if ((SupportedDevices[i].ManufacturerID == ID[0]) && (SupportedDevices[i].ChipID == ID[1])) break;
+		Job* j = &(jobs[i]);
+		if (j->Op != 'e')
+		{
+			j->Data = allocImage(j->Length);
+			if (j->Op != 'r') loadImage(j->Data, j->Seek, j->Length);
+		}
+		check(fwhSubmit(bus, jobOp(j->Op), j->Start, j->Length, j->Data));
+	}
+	FwhError ret = fwhExecute(bus);
+	endProgress();
+	fwhResults(bus, &ops);
+	for (i = 0; i < n; i++)
+	{
+		if ((jobs[i].Op != 'r') || (ops[i].Result != FWH_OK)) continue;
+		if ((fileHandle != -1) && table)
+		{
+			if (!read) dumpOpen();
+			dumpSeek(jobs[i].Seek);
+		}
+		else if (fileHandle != -1)
+		{
+			unsigned char zeros[MAX_BLOCK_LEN] = { 0 };
+			dumpOpen();
+			//Zero padding up to the seek offset (becomes a hole in sparse mode)
+			for (unsigned long s = 0; s < jobs[i].Seek; s += MAX_BLOCK_LEN)
+			{
+				dumpWrite(zeros, ((jobs[i].Seek - s) > MAX_BLOCK_LEN) ? MAX_BLOCK_LEN : (jobs[i].Seek - s));
+			}
+		}
+		else if (table)
+		{
+			printf("Job %u:\n", i);
+		}
+		read = true;
+		saveRead(jobs[i].Start, jobs[i].Length, len, jobs[i].Data);
+	}
+	if (read && (fileHandle != -1)) dumpClose();
+	if (table) printf("\nOp  Start     Length    Offset    Result        Time, s\n");
+	for (i = 0; i < n; i++)
+	{
+		if (table)
+		{
+			printf("%c   %08lx  %08lx  %08lx  %-12s  %.1f\n", jobs[i].Op, jobs[i].Start, jobs[i].Length, jobs[i].Seek,
+				fwhErrorText(ops[i].Result), ops[i].Seconds);
+		}
+		free(jobs[i].Data);
 	}
-	if (i == SUPPORTED_DEV_NUMBER) return NULL;
-	printf("This is %s\n", SupportedDevices[i].Name);
-	return &(SupportedDevices[i]);
+	return ret == FWH_OK;
 }
 
 int main( int argc, char **argv )
 {
 	unsigned long start, length, seek;
 	unsigned int len, i;
-	unsigned char buffer[MAX_BLOCK_LEN], ids[2];
-	unsigned char buffer2[MAX_BLOCK_LEN];
+	unsigned char ids[2];
 	//unsigned char cmdW, cmdR;
-	char flash, erase, readF, verify, id, /*compatible,*/ silent, defaults = 0;
-	char *fileName;
+	char flash, erase, readF, verify, id, locks, /*compatible,*/ silent, defaults = 0;
+	char *fileName, *jobFileName;
+	Job jobs[MAX_JOBS];
+	unsigned int jobCount = 0;
+	FwhConfig config = { .Log = logMessage, .Progress = showProgress };
 
 	//These are mode switches.
 	//Multiple modes can be selected simultaneously, they are executed in a consistent order (argument order does not matter).
 	id = 0; //Read manufacturer + chip ID from the register space (TESTED)
-	erase = 0; //Erase chip (NOT IMPLEMENTED).
-	flash = 0; //Write to the flash memory space (NOT IMPLEMENTED)
+	locks = 0; //Show the block locking registers
+	erase = 0; //Erase chip (sector erase where the chip has it, zeros otherwise).
+	flash = 0; //Write to the flash memory space (bytes that already match are skipped, see the planner in fwh.c)
 	//compatible = 0; //Flash/erase the chip using only standard single-byte writes.
 	readF = 0; //Read the flash memory (TESTED)
-	verify = 0; //Verify the flash memory contents against the specified file (NOT TESTED).
+	verify = 0; //Verify the flash memory contents against the specified file (fused with -e/-w into one sweep).
 	//These are programmer settings
 	start = 0x0; //Start address (in the memory map of the device) for reading and writing
 	length = 0x80000; //R/W length
@@ -581,6 +466,7 @@ int main( int argc, char **argv )
 	//cmdW = 0x10; //Software Command for writing (NOT IMPLEMENTED), defaults to the one suitable for SST49LF016C.
 	seek = 0; //Start address (in the file) for R/W
 	silent = 0; //Don't ask for confirmation of default values
+	jobFileName = 0; //Multiple regions/operations in a single session (overrides modes and -s/-l/-o)
 
 	//Parsing arguments.
 	i = 1; //Index for parsing of command line arguments
@@ -606,14 +492,41 @@ int main( int argc, char **argv )
 		else if((strcmp(argv[i], "-v") == 0)) {
 			verify = 1;
 		}
+		else if((strcmp(argv[i], "-p") == 0)) {
+			dumpMode = DUMP_SPARSE;
+		}
+		else if((strcmp(argv[i], "-z") == 0)) {
+			dumpMode = DUMP_GZIP;
+		}
 		else if(strcmp(argv[i], "-i") == 0)
 		{
 			id = 1;
 		}
+		else if(strcmp(argv[i], "-k") == 0)
+		{
+			locks = 1;
+		}
+		else if(strcmp(argv[i], "-kr") == 0)
+		{
+			config.RestoreLocks = true;
+		}
 		else  if((strcmp(argv[i], "-f") == 0) && (i+1 < argc)) {
 			fileName = argv[++i];
 			printf("Writing (reading) to file %s\n", fileName);
 		}
+		else if((strcmp(argv[i], "-j") == 0) && (i+1 < argc)) {
+			jobFileName = argv[++i];
+		}
+		else if((strcmp(argv[i], "-t") == 0) && (i+1 < argc)) {
+			traceFileName = argv[++i];
+		}
+		else if((strcmp(argv[i], "-u") == 0) && (i+1 < argc)) {
+			config.RemotePort = argv[++i];
+		}
+		else if((strcmp(argv[i], "-g") == 0) && (i+1 < argc)) {
+			config.Gpio = &ChardevBackend;
+			config.GpioDevice = argv[++i];
+		}
 		else if((strcmp(argv[i], "-s") == 0) && (i+1 < argc)) {
 			sscanf(argv[++i], "%lx", &start);
 			defaults++;
@@ -638,7 +551,7 @@ int main( int argc, char **argv )
 		}*/
 		else if(strcmp(argv[i], "-d") == 0)
 		{
-			dbg = true;
+			config.Debug = true;
 		}
 		else {
 			printf("SST49LF016C flash programmer *modified to read SST49LF004B*\n");
@@ -650,6 +563,18 @@ int main( int argc, char **argv )
 			printf(" -r                Read the flash\n");
 			printf(" -v                Verify the flash\n");
 			printf(" -f  filename      Specifies file for writing, reading, verifying\n");
+			printf(" -k                Show block locks (locks covering the range are cleared automatically)\n");
+			printf(" -kr               Restore the cleared block locks when done\n");
+			printf(" -p                Sparse read output: zero-filled blocks become file holes\n");
+			printf(" -z                Gzip-compressed read output (0xFF padding compresses away)\n");
+			printf(" -j  filename      Job file: \"<r|e|w|v> start length [file offset]\" (hex) per line, run in one session\n");
+#ifdef NO_WIRINGPI
+			printf(" -g  device        GPIO character device (default /dev/gpiochip0)\n");
+#else
+			printf(" -g  device        Use a GPIO character device (e.g. /dev/gpiochip0) instead of wiringPi\n");
+#endif
+			printf(" -u  port          Offload bus cycles to a coprocessor on this serial port (see firmware/)\n");
+			printf(" -t  filename      Record a bus trace (every nibble, timestamped) and save it on exit, see fwhtrace\n");
 			printf(" -s  hex (32-bit)  Sets start address (hex, default = 0x0)\n");
 			printf(" -o  hex (32-bit)  Offset in file - Seeks in input file before operation\t\n");
 			printf(" -l  hex (32-bit)  R/W Length (default = 0x80000)\t\n");
@@ -663,23 +588,52 @@ int main( int argc, char **argv )
 		i++;
 	}
 
+	if (jobFileName)
+	{
+		jobCount = loadJobs(jobFileName, jobs);
+		if (jobCount == 0)
+		{
+			printf("Job file is empty!\n");
+			exit(2);
+		}
+		erase = flash = readF = verify = 0;
+		for (i = 0; i < jobCount; i++)
+		{
+			if (jobs[i].Op == 'r') readF = 1;
+			else if (jobs[i].Op == 'e') erase = 1;
+			else if (jobs[i].Op == 'w') flash = 1;
+			else verify = 1;
+		}
+		if (readF && (dumpMode == DUMP_GZIP))
+		{
+			printf("Gzip output can not be used with a job file!\n");
+			exit(2);
+		}
+	}
+
 	//Check if a file had to be specified
-	if(flash || verify) {
+	if(readF && (flash || verify)) {
+		if(fileName) fileHandle = open(fileName, O_RDWR | O_CREAT, 0644);
+	} else if(flash || verify) {
 		if(fileName) fileHandle = open(fileName, O_RDONLY);
 	} else {
-		if(fileName) fileHandle = open(fileName, O_WRONLY | O_CREAT);
+		if(fileName) fileHandle = open(fileName, O_WRONLY | O_CREAT | ((dumpMode == DUMP_GZIP) ? O_TRUNC : 0), 0644);
 	}
-	if(flash && (fileHandle == -1)) {
-		printf("Cannot program flash without file (use -f)\n");
+	if((flash || verify) && (fileHandle == -1)) {
+		printf("Cannot program or verify flash without file (use -f)\n");
 		exit(2);
 	}
 	//Confirm the values that are not required
 	if (len > MAX_BLOCK_LEN)
 	{
-		printf("Maximum block size is %d bytes!\n", MAX_BLOCK_LEN);
+		printf("Maximum block size is %u bytes!\n", MAX_BLOCK_LEN);
 		safeExit(2);
 	}
-	if (silent)
+	if (jobCount > 0)
+	{
+		validateJobs(jobs, jobCount, len);
+	}
+	else if (silent)
 	{
 		printf("Starting address 0x%lx\n", start);
 		printf("Length 0x%lx\n", length);
@@ -707,88 +661,39 @@ int main( int argc, char **argv )
 		}
 	}
 
-	wiringPiSetupGpio();
-	preparePinMode();
-	printf("Pin preparation successful.\n");
+	if (traceFileName && !config.RemotePort) traceStart();
+	config.BlockSize = len;
+	check(fwhOpen(&bus, &config));
+	if (traceFileName && config.RemotePort) printf("Bus cycles are executed by the coprocessor, nothing to trace (-t ignored).\n");
 
-	if (id) readIDs(ids);
+	if (id) check(fwhReadIDs(bus, ids));
+	if (locks) showLocks();
 
-	if (readF)
+	if (jobCount > 0)
 	{
-		readIDs(ids);
-		const Device* dev = findDevice(ids);
-		if (dev != NULL)
-		{
-			executeSCS(dev, false);
-			if (seek > 0)
-			{
-				for (i = 0; i < MAX_BLOCK_LEN; i++) buffer[i] = 0;
-				if (seek > MAX_BLOCK_LEN)
-				{
-					unsigned long s;
-					for (s = 0; s < seek; s += MAX_BLOCK_LEN) write(fileHandle, buffer, MAX_BLOCK_LEN);
-					write(fileHandle, buffer, seek - s + MAX_BLOCK_LEN);
-				}
-				else
-				{
-					write(fileHandle, buffer, seek);
-				}
-			}
-			readChip(start, length, len, buffer);
-		}
-		else
-		{
-			printf("This device is not supported. Use -c if you are sure.\n");
-			safeExit(1);
-		}
-	}
-
-	if (erase) {
-		readIDs(ids);
-		const Device* dev = findDevice(ids);
-		if (dev != NULL)
-		{
-			executeSCS(dev, true);
-			compatibleEraseChip(start, length, len, buffer);
-		}
-		else
-		{
-			printf("This device is not supported. Use -c if you are sure.\n");
-			safeExit(1);
-		}
+		bool ok = runJobs(jobs, jobCount, len, true);
+		printf("Finished.\n");
+		safeExit(ok ? 0 : 1);
 	}
 
-	if (flash) {
-		readIDs(ids);
-		const Device* dev = findDevice(ids);
-		if (dev != NULL)
-		{
-			executeSCS(dev, true);
-			compatibleFlashChip(seek, start, length, len, buffer);
-		}
-		else
-		{
-			printf("This device is not supported. Use -c if you are sure.\n");
-			safeExit(1);
-		}
+	if (flash && (((lseek(fileHandle, 0, SEEK_END)) % len != 0) || (length % len != 0))) {
+		printf("File size is not multiple of block size!\n");
+		safeExit(2);
 	}
-
-	if (verify)
+	//All modes go into one plan, so the chip is detected once and erase/program/verify share a single sweep.
+	//A read into the file that is about to be written/verified has to be saved before the image is loaded.
+	if (readF && (flash || verify) && (fileHandle != -1))
 	{
-		readIDs(ids);
-		const Device* dev = findDevice(ids);
-		if (dev != NULL)
-		{
-			executeSCS(dev, false);
-			verifyChip(seek, start, length, len, buffer, buffer2);
-		}
-		else
-		{
-			printf("This device is not supported. Use -c if you are sure.\n");
-			safeExit(1);
-		}
+		jobs[0] = (Job){ 'r', start, length, seek, NULL };
+		if (!runJobs(jobs, 1, len, false)) safeExit(1);
+		readF = 0;
 	}
+	if (readF) jobs[jobCount++] = (Job){ 'r', start, length, seek, NULL };
+	if (erase) jobs[jobCount++] = (Job){ 'e', start, length, seek, NULL };
+	if (flash) jobs[jobCount++] = (Job){ 'w', start, length, seek, NULL };
+	if (verify) jobs[jobCount++] = (Job){ 'v', start, length, seek, NULL };
+	if ((jobCount > 0) && !runJobs(jobs, jobCount, len, false)) safeExit(1);
 
 	printf("Finished.\n");
 	safeExit(0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,1416 @@
+/*
+
+	libfwh: bus handle, supported device table and the read/erase/program/verify passes (see fwh.h).
+	Bus cycles run either locally (lpc.c) or on the coprocessor (remote.c).
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "fwh.h"
+#include "lpc.h"
+#include "remote.h"
+
+#define MAX_SCS_CYCLES 8u
+#define READBACK_MAP_LEN 0x100000u //Largest FWH part (8 Mbit)
+#define PROGRESS_STEP 0x100u //Program engine progress granularity
+#define SECTOR_ERASE_US 25000u //Sector erase time (datasheet maximum), for bus time estimates
+#define DEFAULT_GPIO_DEVICE "/dev/gpiochip0" //BCM GPIOs on a Pi
+
+static const unsigned long SST49LF004B_WriteAddr[] = { 0x75555, 0x72AAA, 0x75555 };
+static const unsigned char SST49LF004B_WriteCmd[] = { 0xAA, 0x55, 0xA0 };
+static const unsigned long SST49LF004B_EraseAddr[] = { 0x75555, 0x72AAA, 0x75555, 0x75555, 0x72AAA };
+static const unsigned char SST49LF004B_EraseCmd[] = { 0xAA, 0x55, 0x80, 0xAA, 0x55 };
+
+static const FwhDevice SupportedDevices[] =
+{
+	{
+		.Name = "SST49LF004B",
+		.ManufacturerID = 0xBF,
+		.ChipID = 0x60,
+		.WriteOneshot = true,
+		.ReadOneshot = false,
+		.WriteSCSCycles = 3,
+		.ReadSCSCycles = 0,
+		.WriteCommand = SST49LF004B_WriteCmd,
+		.WriteAddress = SST49LF004B_WriteAddr,
+		.ReadCommand = NULL,
+		.ReadAddress = NULL,
+		.EraseSCSCycles = 5,
+		.EraseCommand = SST49LF004B_EraseCmd,
+		.EraseAddress = SST49LF004B_EraseAddr,
+		.SectorEraseCommand = 0x30,
+		.SectorSize = 0x1000,
+		.ChipSize = 0x80000,
+		.BlockSize = 0x10000
+	}
+};
+#define SUPPORTED_DEV_NUMBER (sizeof(SupportedDevices) / sizeof(SupportedDevices[0]))
+
+struct FwhBus
+{
+	FwhConfig Config;
+	bool Remote; //Bus cycles are executed by the coprocessor
+	const FwhDevice* Device; //Detected chip
+	unsigned long FailAddress;
+	//Chip contents learned by data# polling and earlier reads, verification doesn't need the bus for these bytes.
+	unsigned char* ReadbackValue;
+	unsigned char* ReadbackKnown; //Bitmap
+	unsigned char Locks[FWH_MAX_BLOCKS]; //Cached block locking registers
+	bool LocksKnown;
+	unsigned char SavedLocks[FWH_MAX_BLOCKS]; //Register values before fwhUnlock() cleared anything
+	unsigned int SavedMask; //Blocks that have a SavedLocks entry
+	unsigned long KnownBytes; //Verified from the readback map, see reportKnown()
+	FwhOperation Ops[FWH_MAX_OPS];
+	unsigned int OpCount;
+	bool Executed; //Next fwhSubmit() starts a new batch
+};
+
+static FwhBus* openBus = NULL; //lpc.c and remote.c keep global state, so there is only one
+
+static void report(FwhBus* b, FwhLogLevel level, const char* format, ...)
+{
+	char text[256];
+	va_list args;
+	if (b->Config.Log == NULL) return;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	b->Config.Log(level, text, b->Config.Ctx);
+}
+
+//lpc.c debug output, lpcDebugMode is only set while a bus is open
+static void lpcDebugLog(const char* text)
+{
+	if (openBus == NULL) return;
+	if (text == NULL) report(openBus, FWH_LOG_STEP, "Press any key to continue...");
+	else report(openBus, FWH_LOG_DEBUG, "%s", text);
+}
+
+static FwhError ioError(FwhBus* b)
+{
+	report(b, FWH_LOG_ERROR, "GPIO access failed (%s)", strerror(errno));
+	return FWH_ERR_IO;
+}
+
+static void progress(FwhBus* b, FwhOp op, unsigned long addr, unsigned long done, unsigned long total)
+{
+	if (b->Config.Progress != NULL) b->Config.Progress(op, addr, done, total, b->Config.Ctx);
+}
+
+//Only a lost link is FWH_ERR_LINK (for good, until the bus is reopened). A command that failed on the bus gives
+//the error the local engines would have given for it, at the chip address.
+static FwhError coprocError(FwhBus* b)
+{
+	if (remoteLinkFailed())
+	{
+		report(b, FWH_LOG_ERROR, "Coprocessor: %s", remoteError());
+		b->FailAddress = remoteErrorAddress();
+		return FWH_ERR_LINK;
+	}
+	b->FailAddress = remoteErrorAddress() & ~FLASH_SELECT_ADDR;
+	report(b, FWH_LOG_ERROR, "Coprocessor: %s at address %08lx", remoteError(), b->FailAddress);
+	switch (remoteCommandStatus())
+	{
+		case ST_VERIFY: return FWH_ERR_VERIFY;
+		case ST_TIMEOUT: return FWH_ERR_TIMEOUT;
+		default: return FWH_ERR_BUS;
+	}
+}
+
+static void copySink(unsigned long addr, const unsigned char* data, unsigned int len, void* ctx)
+{
+	(void)addr;
+	memcpy(ctx, data, len);
+}
+
+static FwhError busRead(FwhBus* b, unsigned char* buffer, unsigned long addr, unsigned int len)
+{
+	if (b->Remote)
+	{
+		if (!remoteRead(addr, len, len, copySink, buffer) || !remoteSync()) return coprocError(b);
+		return FWH_OK;
+	}
+	switch (lpcReadCycle(buffer, addr, len))
+	{
+		case LPC_OK:
+			return FWH_OK;
+		case LPC_WARN_TAR:
+			report(b, FWH_LOG_WARN, "TAR0 not all ones: %01x at address 0x%lx", lpcBadNibble, addr & ~FLASH_SELECT_ADDR);
+			return FWH_OK;
+		case LPC_ERR_MSIZE:
+			report(b, FWH_LOG_ERROR, "Bad block length specified");
+			return FWH_ERR_BAD_ARG;
+		case LPC_ERR_IO:
+			return ioError(b);
+		default:
+			report(b, FWH_LOG_ERROR, "RSYNC not zero: %01x", lpcBadNibble);
+			return lpcDebugMode ? FWH_OK : FWH_ERR_BUS; //Debug mode goes on, the rest of the cycle is of interest
+	}
+}
+
+static FwhError writeStatus(FwhBus* b, LpcStatus status)
+{
+	switch (status)
+	{
+		case LPC_OK:
+			return FWH_OK;
+		case LPC_ERR_MSIZE:
+			report(b, FWH_LOG_ERROR, "Bad block length specified");
+			return FWH_ERR_BAD_ARG;
+		case LPC_ERR_SYNC:
+			report(b, FWH_LOG_ERROR, "RSYNC not zero");
+			return FWH_ERR_BUS;
+		case LPC_ERR_IO:
+			return ioError(b);
+		default:
+			report(b, FWH_LOG_ERROR, "TAR0 not all ones during a write cycle: 0x%hhx", lpcBadNibble);
+			return FWH_ERR_BUS;
+	}
+}
+
+static FwhError busWrite(FwhBus* b, const unsigned char* buffer, unsigned long addr, unsigned int len)
+{
+	if (b->Remote)
+	{
+		//The coprocessor only does single-byte raw writes
+		for (unsigned int i = 0; i < len; i++) remoteWrite(addr + i, buffer[i]);
+		if (!remoteSync()) return coprocError(b);
+		return FWH_OK;
+	}
+	return writeStatus(b, lpcWriteCycle(buffer, addr, len));
+}
+
+//The map is only an optimization: if it can't be allocated, verification reads everything back.
+static void readbackSet(FwhBus* b, unsigned long addr, unsigned char value)
+{
+	if (addr >= READBACK_MAP_LEN) return;
+	if (b->ReadbackKnown == NULL)
+	{
+		b->ReadbackValue = malloc(READBACK_MAP_LEN);
+		b->ReadbackKnown = calloc(READBACK_MAP_LEN / 8, 1);
+		if ((b->ReadbackValue == NULL) || (b->ReadbackKnown == NULL))
+		{
+			free(b->ReadbackValue);
+			free(b->ReadbackKnown);
+			b->ReadbackValue = b->ReadbackKnown = NULL;
+			return;
+		}
+	}
+	b->ReadbackValue[addr] = value;
+	b->ReadbackKnown[addr / 8] |= 1 << (addr % 8);
+}
+
+static void readbackForget(FwhBus* b, unsigned long start, unsigned long length)
+{
+	if (b->ReadbackKnown == NULL) return;
+	for (unsigned long addr = start; (addr < start + length) && (addr < READBACK_MAP_LEN); addr++)
+	{
+		b->ReadbackKnown[addr / 8] &= ~(1 << (addr % 8));
+	}
+}
+
+//Nothing survives a detection, the chip may have been swapped in between
+static void readbackClear(FwhBus* b)
+{
+	if (b->ReadbackKnown != NULL) memset(b->ReadbackKnown, 0, READBACK_MAP_LEN / 8);
+}
+
+//Returns true (and the data) only if the whole block is known
+static bool readbackGet(FwhBus* b, unsigned char* buffer, unsigned long addr, unsigned int len)
+{
+	if ((b->ReadbackKnown == NULL) || (addr + len > READBACK_MAP_LEN)) return false;
+	for (unsigned int i = 0; i < len; i++)
+	{
+		if (!(b->ReadbackKnown[(addr + i) / 8] & (1 << ((addr + i) % 8)))) return false;
+	}
+	memcpy(buffer, b->ReadbackValue + addr, len);
+	return true;
+}
+
+static FwhError checkExtent(FwhBus* b, unsigned long start, unsigned long length)
+{
+	if ((start % b->Config.BlockSize != 0) || (length % b->Config.BlockSize != 0))
+	{
+		report(b, FWH_LOG_ERROR, "Start and length have to be multiples of the block size");
+		return FWH_ERR_BAD_ARG;
+	}
+	return FWH_OK;
+}
+
+typedef struct
+{
+	FwhBus* Bus;
+	FwhOp Op;
+	unsigned long Start;
+	unsigned long Length;
+	unsigned char* Data;
+} ReadContext;
+
+static void readSink(unsigned long addr, const unsigned char* data, unsigned int len, void* ctx)
+{
+	ReadContext* r = (ReadContext*)ctx;
+	addr &= ~FLASH_SELECT_ADDR;
+	progress(r->Bus, r->Op, addr, addr - r->Start, r->Length);
+	memcpy(r->Data + (addr - r->Start), data, len);
+}
+
+//Whatever is read goes into the readback map as well, later passes don't have to read it again.
+//Op is the operation the read is done for (progress reporting).
+static FwhError readExtent(FwhBus* b, FwhOp op, unsigned long start, unsigned long length, unsigned char* data)
+{
+	unsigned long addr, end = start + length;
+	unsigned int len = b->Config.BlockSize;
+	FwhError ret;
+	if (b->Remote)
+	{
+		ReadContext ctx = { b, op, start, length, data };
+		if (!remoteRead(start | FLASH_SELECT_ADDR, length, len, readSink, &ctx) || !remoteSync()) return coprocError(b);
+	}
+	else
+	{
+		for (addr = start; addr < end; addr += len)
+		{
+			progress(b, op, addr, addr - start, length);
+			//Bit 22 directs reads to flash (not registers)
+			if ((ret = busRead(b, data + (addr - start), addr | FLASH_SELECT_ADDR, len)) != FWH_OK) return ret;
+		}
+	}
+	for (addr = 0; addr < length; addr++) readbackSet(b, start + addr, data[addr]);
+	return FWH_OK;
+}
+
+typedef struct
+{
+	FwhBus* Bus;
+	bool Ok;
+	unsigned long Start;
+	unsigned long Length;
+	const unsigned char* Image;
+} VerifyContext;
+
+//Compares a block read from the chip against the image
+static void verifyBlock(VerifyContext* v, unsigned long addr, const unsigned char* data, unsigned int len)
+{
+	const unsigned char* expected = v->Image + (addr - v->Start);
+	if (memcmp(data, expected, len) == 0) return;
+	for (unsigned int i = 0; i < len; i++)
+	{
+		if (data[i] == expected[i]) continue;
+		report(v->Bus, FWH_LOG_ERROR, "Verify error at address %08lx R:%02x F:%02x", addr + i, data[i], expected[i]);
+		if (v->Ok) v->Bus->FailAddress = addr + i;
+		v->Ok = false;
+	}
+}
+
+static void verifySink(unsigned long addr, const unsigned char* data, unsigned int len, void* ctx)
+{
+	VerifyContext* v = (VerifyContext*)ctx;
+	addr &= ~FLASH_SELECT_ADDR;
+	progress(v->Bus, FWH_OP_VERIFY, addr, addr - v->Start, v->Length);
+	if (v->Ok) verifyBlock(v, addr, data, len); //Report the first mismatching chunk only, like the local loop
+}
+
+//Stops at the first mismatching block
+static FwhError verifyExtent(FwhBus* b, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	unsigned char buffer[MAX_BLOCK_LEN];
+	unsigned int len = b->Config.BlockSize;
+	unsigned long addr, end = start + length;
+	unsigned long run = end; //Start of the pending remote read
+	VerifyContext ctx = { b, true, start, length, image };
+	FwhError ret;
+	for (addr = start; (addr < end) && ctx.Ok; addr += len)
+	{
+		if (readbackGet(b, buffer, addr, len))
+		{
+			if (run != end) remoteRead(run | FLASH_SELECT_ADDR, addr - run, len, verifySink, &ctx);
+			run = end;
+			b->KnownBytes += len;
+		}
+		else if (b->Remote)
+		{
+			if (run == end) run = addr;
+			continue;
+		}
+		else if ((ret = busRead(b, buffer, addr | FLASH_SELECT_ADDR, len)) != FWH_OK)
+		{
+			return ret;
+		}
+		progress(b, FWH_OP_VERIFY, addr, addr - start, length);
+		verifyBlock(&ctx, addr, buffer, len);
+	}
+	if (b->Remote)
+	{
+		if ((run != end) && ctx.Ok) remoteRead(run | FLASH_SELECT_ADDR, end - run, len, verifySink, &ctx);
+		if (!remoteSync()) return coprocError(b);
+	}
+	return ctx.Ok ? FWH_OK : FWH_ERR_VERIFY;
+}
+
+static void reportKnown(FwhBus* b)
+{
+	if (b->KnownBytes > 0) report(b, FWH_LOG_INFO, "0x%lx bytes were verified without reading them back (known from data# polling or earlier reads).", b->KnownBytes);
+	b->KnownBytes = 0;
+}
+
+//Program engine for devices with a program SCS. While the chip is busy with byte N, the cycle for byte N+1 is prepared,
+//and the data# polling of byte N doubles as its verification. 0xFF bytes are skipped (programming can't set bits),
+//those are left for the verify pass.
+static FwhError programExtent(FwhBus* b, FwhOp op, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	const FwhDevice* dev = b->Device;
+	LpcFrame scs[MAX_SCS_CYCLES], frames[2];
+	unsigned long i, next, addr;
+	unsigned char value, c, cur = 0;
+	LpcStatus status;
+	FwhError ret = FWH_OK;
+	for (c = 0; c < dev->WriteSCSCycles; c++) lpcBuildWrite(&(scs[c]), &(dev->WriteCommand[c]), dev->WriteAddress[c], 1);
+	for (i = 0; (i < length) && (image[i] == 0xFF); i++);
+	if (i < length) lpcBuildWrite(&(frames[cur]), image + i, (start + i) | FLASH_SELECT_ADDR, 1);
+	lpcEnableWrite(true);
+	while (i < length)
+	{
+		addr = start + i;
+		if ((i % PROGRESS_STEP) == 0) progress(b, op, addr, i, length);
+		if (dev->WriteOneshot)
+		{
+			for (c = 0; (c < dev->WriteSCSCycles) && (ret == FWH_OK); c++) ret = writeStatus(b, lpcSendWrite(&(scs[c])));
+		}
+		if ((ret != FWH_OK) || ((ret = writeStatus(b, lpcSendWrite(&(frames[cur])))) != FWH_OK)) break;
+		//The chip is busy now: prepare the next byte
+		for (next = i + 1; (next < length) && (image[next] == 0xFF); next++);
+		if (next < length) lpcBuildWrite(&(frames[cur ^ 1]), image + next, (start + next) | FLASH_SELECT_ADDR, 1);
+		status = lpcDataPoll(addr | FLASH_SELECT_ADDR, image[i], &value, POLL_LIMIT);
+		if (status == LPC_ERR_TIMEOUT)
+		{
+			report(b, FWH_LOG_ERROR, "Programming timeout at address %08lx (is the block locked?)", addr);
+			b->FailAddress = addr;
+			ret = FWH_ERR_TIMEOUT;
+			break;
+		}
+		if (status == LPC_ERR_IO)
+		{
+			ret = ioError(b);
+			break;
+		}
+		if (status != LPC_OK)
+		{
+			report(b, FWH_LOG_ERROR, "Bus error while polling address %08lx", addr);
+			ret = FWH_ERR_BUS;
+			break;
+		}
+		if (value != image[i])
+		{
+			report(b, FWH_LOG_ERROR, "Program error at address %08lx R:%02x F:%02x", addr, value, image[i]);
+			b->FailAddress = addr;
+			ret = FWH_ERR_VERIFY;
+			break;
+		}
+		readbackSet(b, addr, value);
+		i = next;
+		cur ^= 1;
+	}
+	lpcEnableWrite(false);
+	return ret;
+}
+
+//The coprocessor polls (and checks) every byte itself. Like the local engine, 0xFF bytes are skipped on devices
+//with a program SCS: they would fail polling wherever the chip isn't blank, and are left for the verify pass.
+static FwhError remoteProgramExtent(FwhBus* b, FwhOp op, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	bool skip = (b->Device->WriteSCSCycles > 0);
+	unsigned long addr = 0, n;
+	while (addr < length)
+	{
+		for (; skip && (addr < length) && (image[addr] == 0xFF); addr++);
+		for (n = 0; (addr + n < length) && (n < REMOTE_CHUNK) && !(skip && (image[addr + n] == 0xFF)); n++);
+		if (n == 0) break;
+		progress(b, op, start + addr, addr, length);
+		if (!remoteProgram((start + addr) | FLASH_SELECT_ADDR, image + addr, n)) return coprocError(b);
+		addr += n;
+	}
+	FwhError ret = remoteSync() ? FWH_OK : coprocError(b);
+	if (!skip || ((ret != FWH_OK) && (ret != FWH_ERR_VERIFY) && (ret != FWH_ERR_TIMEOUT))) return ret;
+	//Polled and checked up to the failing byte, nothing after it was programmed
+	for (addr = 0; (addr < length) && ((ret == FWH_OK) || (start + addr < b->FailAddress)); addr++)
+	{
+		if (image[addr] != 0xFF) readbackSet(b, start + addr, image[addr]);
+	}
+	return ret;
+}
+
+//Writes the image using the best way available for the device
+static FwhError writeImage(FwhBus* b, FwhOp op, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	FwhError ret = FWH_OK;
+	unsigned int len = b->Config.BlockSize;
+	unsigned long addr, end = length + start;
+	readbackForget(b, start, length);
+	if (b->Remote)
+	{
+		ret = remoteProgramExtent(b, op, start, length, image);
+	}
+	else if (b->Device->WriteSCSCycles > 0)
+	{
+		ret = programExtent(b, op, start, length, image);
+	}
+	else
+	{
+		lpcEnableWrite(true);
+		for (addr = start; (addr < end) && (ret == FWH_OK); addr += len)
+		{
+			progress(b, op, addr, addr - start, length);
+			ret = busWrite(b, image + (addr - start), addr | FLASH_SELECT_ADDR, len);
+		}
+		lpcEnableWrite(false);
+	}
+	usleep(1000);
+	return ret;
+}
+
+//Erase SCS followed by the sector erase command, completion is polled for 0xFF
+static FwhError eraseSector(FwhBus* b, unsigned long addr)
+{
+	const FwhDevice* dev = b->Device;
+	unsigned char value;
+	LpcStatus status;
+	FwhError ret = FWH_OK;
+	readbackForget(b, addr, dev->SectorSize);
+	if (b->Remote)
+	{
+		if (!remoteErase(addr | FLASH_SELECT_ADDR, dev->SectorEraseCommand) || !remoteSync()) return coprocError(b);
+		return FWH_OK;
+	}
+	lpcEnableWrite(true);
+	for (unsigned char c = 0; (c < dev->EraseSCSCycles) && (ret == FWH_OK); c++)
+	{
+		ret = busWrite(b, &(dev->EraseCommand[c]), dev->EraseAddress[c], 1);
+	}
+	if (ret == FWH_OK) ret = busWrite(b, &(dev->SectorEraseCommand), addr | FLASH_SELECT_ADDR, 1);
+	if (ret == FWH_OK)
+	{
+		status = lpcDataPoll(addr | FLASH_SELECT_ADDR, 0xFF, &value, POLL_LIMIT);
+		if (status == LPC_ERR_TIMEOUT)
+		{
+			report(b, FWH_LOG_ERROR, "Erase timeout at sector %08lx (is the block locked?)", addr);
+			b->FailAddress = addr;
+			ret = FWH_ERR_TIMEOUT;
+		}
+		else if (status == LPC_ERR_IO)
+		{
+			ret = ioError(b);
+		}
+		else if (status != LPC_OK)
+		{
+			report(b, FWH_LOG_ERROR, "Bus error while polling address %08lx", addr);
+			ret = FWH_ERR_BUS;
+		}
+	}
+	lpcEnableWrite(false);
+	return ret;
+}
+
+static bool canEraseSectors(FwhBus* b, unsigned long start, unsigned long length)
+{
+	const FwhDevice* dev = b->Device;
+	return (dev->EraseSCSCycles > 0) && (dev->SectorSize > 0) && (start % dev->SectorSize == 0) && (length % dev->SectorSize == 0);
+}
+
+//Sector erase where the device has it, otherwise the extent is overwritten with zeros
+static FwhError eraseExtent(FwhBus* b, unsigned long start, unsigned long length)
+{
+	FwhError ret = FWH_OK;
+	if (canEraseSectors(b, start, length))
+	{
+		for (unsigned long addr = start; (addr < start + length) && (ret == FWH_OK); addr += b->Device->SectorSize)
+		{
+			progress(b, FWH_OP_ERASE, addr, addr - start, length);
+			ret = eraseSector(b, addr);
+		}
+		return ret;
+	}
+	unsigned char* zeros = calloc(length, 1);
+	if (zeros == NULL)
+	{
+		report(b, FWH_LOG_ERROR, "Out of memory");
+		return FWH_ERR_NO_MEMORY;
+	}
+	ret = writeImage(b, FWH_OP_ERASE, start, length, zeros);
+	free(zeros);
+	return ret;
+}
+
+static FwhError executeSCS(FwhBus* b, bool w)
+{
+	const FwhDevice* dev = b->Device;
+	FwhError ret = FWH_OK;
+	if (w && (b->Remote || dev->WriteOneshot)) return FWH_OK; //Issued before every byte by the program engine or the coprocessor
+	if (w)
+	{
+		for (unsigned char i = 0; (i < dev->WriteSCSCycles) && (ret == FWH_OK); i++)
+		{
+			ret = busWrite(b, &(dev->WriteCommand[i]), dev->WriteAddress[i], 1);
+		}
+	}
+	else
+	{
+		for (unsigned char i = 0; (i < dev->ReadSCSCycles) && (ret == FWH_OK); i++)
+		{
+			ret = busWrite(b, &(dev->ReadCommand[i]), dev->ReadAddress[i], 1);
+		}
+	}
+	return ret;
+}
+
+//Hands the device's SCS tables over to the coprocessor
+static FwhError configureRemote(FwhBus* b)
+{
+	const FwhDevice* dev = b->Device;
+	remoteSetSCS(SCS_KIND_PROGRAM, dev->WriteSCSCycles, dev->WriteAddress, dev->WriteCommand);
+	remoteSetSCS(SCS_KIND_ERASE, dev->EraseSCSCycles, dev->EraseAddress, dev->EraseCommand);
+	if (!remoteSync()) return coprocError(b);
+	return FWH_OK;
+}
+
+static FwhError ensureDevice(FwhBus* b)
+{
+	return (b->Device != NULL) ? FWH_OK : fwhDetect(b, NULL);
+}
+
+static double elapsedSince(const struct timespec* t0)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - t0->tv_sec) + (t.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+//E.g. 0xFFB80002 for the first block of a 4 Mbit part
+static unsigned long lockRegister(const FwhDevice* dev, unsigned int block)
+{
+	return 0xFFC00000 - dev->ChipSize + block * dev->BlockSize + 2;
+}
+
+static unsigned int blockCount(const FwhDevice* dev)
+{
+	if (dev->BlockSize == 0) return 0;
+	return ((dev->ChipSize / dev->BlockSize) > FWH_MAX_BLOCKS) ? FWH_MAX_BLOCKS : (dev->ChipSize / dev->BlockSize);
+}
+
+//Writes a block locking register and reads it back, so a lock that didn't clear is caught before any program/erase
+static FwhError writeLock(FwhBus* b, unsigned int block, unsigned char value)
+{
+	unsigned long reg = lockRegister(b->Device, block);
+	unsigned char check;
+	FwhError ret;
+	if (!b->Remote) lpcEnableWrite(true);
+	ret = busWrite(b, &value, reg, 1);
+	if (!b->Remote) lpcEnableWrite(false);
+	if ((ret != FWH_OK) || ((ret = busRead(b, &check, reg, 1)) != FWH_OK)) return ret;
+	b->Locks[block] = check;
+	if ((check ^ value) & (FWH_LOCK_WRITE | FWH_LOCK_READ))
+	{
+		report(b, FWH_LOG_ERROR, "Block %u lock register reads 0x%02x after writing 0x%02x", block, check, value);
+		b->FailAddress = block * b->Device->BlockSize;
+		return FWH_ERR_LOCKED;
+	}
+	return FWH_OK;
+}
+
+FwhError fwhOpen(FwhBus** bus, const FwhConfig* config)
+{
+	FwhBus* b;
+	*bus = NULL;
+	if (openBus != NULL) return FWH_ERR_BUSY;
+	b = calloc(1, sizeof(FwhBus));
+	if (b == NULL) return FWH_ERR_NO_MEMORY;
+	b->Config = *config;
+	if (b->Config.BlockSize == 0) b->Config.BlockSize = 1;
+#ifdef NO_WIRINGPI
+	if (b->Config.Gpio == NULL) b->Config.Gpio = &ChardevBackend;
+#else
+	if (b->Config.Gpio == NULL) b->Config.Gpio = &WiringPiBackend;
+#endif
+	if (b->Config.GpioDevice == NULL) b->Config.GpioDevice = DEFAULT_GPIO_DEVICE;
+	if ((b->Config.BlockSize > MAX_BLOCK_LEN) || (lpcReadMSize(b->Config.BlockSize) == MSIZE_INVALID))
+	{
+		report(b, FWH_LOG_ERROR, "Bad block length specified (maximum is %u bytes)", MAX_BLOCK_LEN);
+		free(b);
+		return FWH_ERR_BAD_ARG;
+	}
+	lpcDebugMode = b->Config.Debug;
+	lpcDebug = lpcDebugLog;
+	if (b->Config.RemotePort != NULL)
+	{
+		if (!remoteOpen(b->Config.RemotePort))
+		{
+			report(b, FWH_LOG_ERROR, "Coprocessor: %s", remoteError());
+			free(b);
+			return FWH_ERR_IO;
+		}
+		b->Remote = true;
+		report(b, FWH_LOG_INFO, "Coprocessor link is open.");
+	}
+	else
+	{
+		lpcGpio = b->Config.Gpio;
+		errno = 0;
+		if (!lpcGpio->Init(b->Config.GpioDevice, &lpcPins))
+		{
+			report(b, FWH_LOG_ERROR, "Can not initialize %s GPIO backend%s%s", lpcGpio->Name, errno ? ": " : "", errno ? strerror(errno) : "");
+			free(b);
+			return FWH_ERR_IO;
+		}
+		openBus = b; //Debug output of the pin preparation goes to the log already
+		if (lpcPreparePins() != LPC_OK)
+		{
+			ioError(b);
+			lpcGpio->Close();
+			free(b);
+			openBus = NULL;
+			return FWH_ERR_IO;
+		}
+		report(b, FWH_LOG_INFO, "Pin preparation successful.");
+	}
+	openBus = b;
+	*bus = b;
+	return FWH_OK;
+}
+
+void fwhClose(FwhBus* b)
+{
+	if (b == NULL) return;
+	if (b->Remote)
+	{
+		remoteClose();
+	}
+	else
+	{
+		lpcGpio->Write(lpcPins.Rst, LOW);
+		lpcGpio->PinMode(lpcPins.Rst, OUTPUT);
+		lpcEnableWrite(false);
+		lpcSetLADInputZ(true);
+		lpcGpio->PinMode(lpcPins.Wr, INPUT);
+		lpcGpio->PinMode(lpcPins.Lframe, INPUT);
+		lpcGpio->PinMode(lpcPins.Lclk, INPUT);
+		lpcGpio->Close();
+	}
+	free(b->ReadbackValue);
+	free(b->ReadbackKnown);
+	free(b);
+	openBus = NULL;
+}
+
+const char* fwhErrorText(FwhError error)
+{
+	switch (error)
+	{
+		case FWH_OK: return "OK";
+		case FWH_ERR_BAD_ARG: return "Bad argument";
+		case FWH_ERR_BUSY: return "Bus is already open";
+		case FWH_ERR_IO: return "Can not open or access the bus";
+		case FWH_ERR_NO_MEMORY: return "Out of memory";
+		case FWH_ERR_BUS: return "Bus error";
+		case FWH_ERR_LINK: return "Coprocessor error";
+		case FWH_ERR_UNSUPPORTED: return "Device is not supported";
+		case FWH_ERR_TIMEOUT: return "Timeout";
+		case FWH_ERR_LOCKED: return "Locked down";
+		case FWH_ERR_VERIFY: return "Verify error";
+		case FWH_ERR_NOT_RUN: return "Not run";
+		default: return "Unknown error";
+	}
+}
+
+FwhError fwhReadIDs(FwhBus* b, unsigned char* ids)
+{
+	FwhError ret;
+	report(b, FWH_LOG_INFO, "Reading manufacturer ID...");
+	//From SST49LF004B datasheet. JEDEC-defined registers should be the same for all FWH chips.
+	if ((ret = busRead(b, &(ids[0]), 0xFFBC0000, 1)) != FWH_OK) return ret;
+	report(b, FWH_LOG_INFO, "Manufacturer ID: 0x%hhx", ids[0]);
+	report(b, FWH_LOG_INFO, "Reading chip ID...");
+	if ((ret = busRead(b, &(ids[1]), 0xFFBC0001, 1)) != FWH_OK) return ret;
+	report(b, FWH_LOG_INFO, "Chip ID: 0x%hhx", ids[1]);
+	return FWH_OK;
+}
+
+FwhError fwhDetect(FwhBus* b, const FwhDevice** device)
+{
+	unsigned char ids[2];
+	unsigned int i;
+	FwhError ret;
+	readbackClear(b);
+	if ((ret = fwhReadIDs(b, ids)) != FWH_OK) return ret;
+	for (i = 0; i < SUPPORTED_DEV_NUMBER; i++)
+	{
+		if ((SupportedDevices[i].ManufacturerID == ids[0]) && (SupportedDevices[i].ChipID == ids[1])) break;
+	}
+	if (i == SUPPORTED_DEV_NUMBER)
+	{
+		report(b, FWH_LOG_ERROR, "This device is not supported");
+		return FWH_ERR_UNSUPPORTED;
+	}
+	report(b, FWH_LOG_INFO, "This is %s", SupportedDevices[i].Name);
+	//A swapped or reset chip comes up with its power-on locks, so nothing cached about them is trusted either
+	b->LocksKnown = false;
+	b->SavedMask = 0;
+	b->Device = &(SupportedDevices[i]);
+	if (b->Remote && ((ret = configureRemote(b)) != FWH_OK)) return ret;
+	if (device != NULL) *device = b->Device;
+	return FWH_OK;
+}
+
+unsigned long fwhFailAddress(const FwhBus* b)
+{
+	return b->FailAddress;
+}
+
+FwhError fwhReadLocks(FwhBus* b, const unsigned char** locks, unsigned int* count)
+{
+	unsigned int i, n;
+	FwhError ret;
+	if ((ret = ensureDevice(b)) != FWH_OK) return ret;
+	n = blockCount(b->Device);
+	if (!b->LocksKnown)
+	{
+		if (b->Remote)
+		{
+			//A single batch for the whole sweep
+			for (i = 0; i < n; i++) remoteRead(lockRegister(b->Device, i), 1, 1, copySink, &(b->Locks[i]));
+			if (!remoteSync()) return coprocError(b);
+		}
+		else
+		{
+			for (i = 0; i < n; i++)
+			{
+				if ((ret = busRead(b, &(b->Locks[i]), lockRegister(b->Device, i), 1)) != FWH_OK) return ret;
+			}
+		}
+		b->LocksKnown = true;
+	}
+	if (locks != NULL) *locks = b->Locks;
+	if (count != NULL) *count = n;
+	return FWH_OK;
+}
+
+FwhError fwhUnlock(FwhBus* b, unsigned long start, unsigned long length, unsigned char bits)
+{
+	unsigned int i, n, first, last;
+	FwhError ret;
+	if ((ret = fwhReadLocks(b, NULL, &n)) != FWH_OK) return ret;
+	if ((n == 0) || (length == 0)) return FWH_OK;
+	bits &= FWH_LOCK_WRITE | FWH_LOCK_READ;
+	first = start / b->Device->BlockSize;
+	last = (start + length - 1) / b->Device->BlockSize;
+	if (last >= n) last = n - 1;
+	//Locked down blocks are rejected up front, so nothing gets touched if the operation can't be done anyway
+	for (i = first; i <= last; i++)
+	{
+		if ((b->Locks[i] & bits) && (b->Locks[i] & FWH_LOCK_DOWN))
+		{
+			report(b, FWH_LOG_ERROR, "Block %u (%08lx) is locked down until reset", i, i * b->Device->BlockSize);
+			b->FailAddress = i * b->Device->BlockSize;
+			return FWH_ERR_LOCKED;
+		}
+	}
+	for (i = first; i <= last; i++)
+	{
+		if (!(b->Locks[i] & bits)) continue;
+		if (!(b->SavedMask & (1u << i)))
+		{
+			b->SavedLocks[i] = b->Locks[i];
+			b->SavedMask |= 1u << i;
+		}
+		if ((ret = writeLock(b, i, b->Locks[i] & ~bits)) != FWH_OK) return ret;
+	}
+	return FWH_OK;
+}
+
+FwhError fwhRestoreLocks(FwhBus* b)
+{
+	FwhError ret = FWH_OK;
+	for (unsigned int i = 0; (i < FWH_MAX_BLOCKS) && (ret == FWH_OK); i++)
+	{
+		if (!(b->SavedMask & (1u << i))) continue;
+		b->SavedMask &= ~(1u << i);
+		ret = writeLock(b, i, b->SavedLocks[i] & (FWH_LOCK_WRITE | FWH_LOCK_READ));
+	}
+	return ret;
+}
+
+static FwhError restoreLocks(FwhBus* b, FwhError ret)
+{
+	FwhError r;
+	if (!b->Config.RestoreLocks || (b->SavedMask == 0)) return ret;
+	r = fwhRestoreLocks(b);
+	return (ret != FWH_OK) ? ret : r;
+}
+
+//Reads only need the read locks cleared, erase the write locks. Program needs both: the chip contents are read
+//before programming (skipping matching bytes, the readback map) and data# polling reads the bytes being written.
+static unsigned char lockBits(FwhOp op)
+{
+	if (op == FWH_OP_PROGRAM) return FWH_LOCK_WRITE | FWH_LOCK_READ;
+	return (op == FWH_OP_ERASE) ? FWH_LOCK_WRITE : FWH_LOCK_READ;
+}
+
+static FwhError prepare(FwhBus* b, FwhOp op, unsigned long start, unsigned long length)
+{
+	FwhError ret;
+	if (((ret = checkExtent(b, start, length)) != FWH_OK) || ((ret = ensureDevice(b)) != FWH_OK)) return ret;
+	if ((ret = fwhUnlock(b, start, length, lockBits(op))) != FWH_OK) return ret;
+	return executeSCS(b, (lockBits(op) & FWH_LOCK_WRITE) != 0);
+}
+
+FwhError fwhRead(FwhBus* b, unsigned long start, unsigned long length, unsigned char* data)
+{
+	FwhError ret;
+	if ((ret = prepare(b, FWH_OP_READ, start, length)) != FWH_OK) return ret;
+	return restoreLocks(b, readExtent(b, FWH_OP_READ, start, length, data));
+}
+
+FwhError fwhErase(FwhBus* b, unsigned long start, unsigned long length)
+{
+	FwhError ret;
+	if ((ret = prepare(b, FWH_OP_ERASE, start, length)) != FWH_OK) return ret;
+	return restoreLocks(b, eraseExtent(b, start, length));
+}
+
+FwhError fwhProgram(FwhBus* b, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	FwhError ret;
+	if ((ret = prepare(b, FWH_OP_PROGRAM, start, length)) != FWH_OK) return ret;
+	return restoreLocks(b, writeImage(b, FWH_OP_PROGRAM, start, length, image));
+}
+
+FwhError fwhVerify(FwhBus* b, unsigned long start, unsigned long length, const unsigned char* image)
+{
+	FwhError ret;
+	if ((ret = prepare(b, FWH_OP_VERIFY, start, length)) != FWH_OK) return ret;
+	ret = verifyExtent(b, start, length, image);
+	reportKnown(b);
+	return restoreLocks(b, ret);
+}
+
+FwhError fwhSubmit(FwhBus* b, FwhOp op, unsigned long start, unsigned long length, unsigned char* data)
+{
+	FwhError ret;
+	if (b->Executed)
+	{
+		b->OpCount = 0;
+		b->Executed = false;
+	}
+	if (b->OpCount == FWH_MAX_OPS)
+	{
+		report(b, FWH_LOG_ERROR, "Too many operations, maximum is %u", FWH_MAX_OPS);
+		return FWH_ERR_BAD_ARG;
+	}
+	if ((length == 0) || ((data == NULL) && (op != FWH_OP_ERASE)))
+	{
+		report(b, FWH_LOG_ERROR, "Operation %u: empty extent or no data", b->OpCount);
+		return FWH_ERR_BAD_ARG;
+	}
+	if ((ret = checkExtent(b, start, length)) != FWH_OK) return ret;
+	for (unsigned int i = 0; i < b->OpCount; i++)
+	{
+		if ((b->Ops[i].Op == op) && (start < b->Ops[i].Start + b->Ops[i].Length) && (b->Ops[i].Start < start + length))
+		{
+			report(b, FWH_LOG_ERROR, "Operations %u and %u overlap in chip address space", i, b->OpCount);
+			return FWH_ERR_BAD_ARG;
+		}
+	}
+	FwhOperation* o = &(b->Ops[b->OpCount++]);
+	o->Op = op;
+	o->Start = start;
+	o->Length = length;
+	o->Data = data;
+	o->Result = FWH_ERR_NOT_RUN;
+	o->FailAddress = 0;
+	o->Seconds = 0;
+	return FWH_OK;
+}
+
+static int compareOps(const void* a, const void* b)
+{
+	const FwhOperation* x = *(const FwhOperation* const*)a;
+	const FwhOperation* y = *(const FwhOperation* const*)b;
+	if (x->Op != y->Op) return (int)x->Op - (int)y->Op;
+	if (x->Start != y->Start) return (x->Start < y->Start) ? -1 : 1;
+	return 0;
+}
+
+//Executes adjacent operations of the same kind as a single pass over the chip
+static FwhError runOps(FwhBus* b, FwhOperation** ops, unsigned int count)
+{
+	struct timespec t0;
+	unsigned long start = ops[0]->Start, length = 0, offset;
+	unsigned char* data = ops[0]->Data;
+	unsigned int i;
+	FwhError ret;
+	for (i = 0; i < count; i++) length += ops[i]->Length;
+	//Merged runs need their data in one piece
+	if ((count > 1) && (ops[0]->Op != FWH_OP_ERASE))
+	{
+		data = malloc(length);
+		if (data == NULL)
+		{
+			report(b, FWH_LOG_ERROR, "Out of memory");
+			for (i = 0; i < count; i++) ops[i]->Result = FWH_ERR_NO_MEMORY;
+			return FWH_ERR_NO_MEMORY;
+		}
+		if (ops[0]->Op != FWH_OP_READ)
+		{
+			for (offset = 0, i = 0; i < count; offset += ops[i]->Length, i++) memcpy(data + offset, ops[i]->Data, ops[i]->Length);
+		}
+	}
+	b->FailAddress = start + length;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (ops[0]->Op)
+	{
+		case FWH_OP_READ:
+			ret = readExtent(b, FWH_OP_READ, start, length, data);
+			break;
+		case FWH_OP_ERASE:
+			ret = eraseExtent(b, start, length);
+			break;
+		case FWH_OP_PROGRAM:
+			ret = writeImage(b, FWH_OP_PROGRAM, start, length, data);
+			break;
+		default:
+			ret = verifyExtent(b, start, length, data);
+			reportKnown(b);
+			break;
+	}
+	double seconds = elapsedSince(&t0);
+	for (offset = 0, i = 0; i < count; offset += ops[i]->Length, i++)
+	{
+		FwhOperation* o = ops[i];
+		o->Seconds = seconds * o->Length / length;
+		if ((ret == FWH_ERR_VERIFY) || (ret == FWH_ERR_TIMEOUT))
+		{
+			//Passes stop at the first failure: operations before it are done, the ones after it never ran
+			if (b->FailAddress >= o->Start + o->Length) o->Result = FWH_OK;
+			else if (b->FailAddress < o->Start) o->Result = FWH_ERR_NOT_RUN;
+			else
+			{
+				o->Result = ret;
+				o->FailAddress = b->FailAddress;
+			}
+		}
+		else
+		{
+			o->Result = ret;
+		}
+		if ((o->Op == FWH_OP_READ) && (data != o->Data) && (o->Result == FWH_OK)) memcpy(o->Data, data + offset, o->Length);
+	}
+	if (data != ops[0]->Data) free(data);
+	return ret;
+}
+
+//Fused plan: erase, program and verify operations are run sector by sector in one sweep. A sector is erased only if
+//its known contents can't be programmed into the image, only bytes that differ from the chip are programmed,
+//and verification reuses what pre-reads and data# polling have learned.
+typedef struct
+{
+	unsigned long ReadCycles; //Bus cycles, for the estimate
+	unsigned long WriteCycles;
+	unsigned long Erased; //Sectors
+	unsigned long EraseSkipped;
+	unsigned long Programmed; //Bytes
+	unsigned long ProgramSkipped;
+} PlanStats;
+
+//Needs a program SCS (0xFF bytes can be skipped) and sector erase, erase extents have to cover whole sectors
+static bool canFuse(FwhBus* b, FwhOperation** ops, unsigned int count)
+{
+	const FwhDevice* dev = b->Device;
+	if ((dev->WriteSCSCycles == 0) || (dev->ReadSCSCycles > 0) || !(b->Remote || dev->WriteOneshot)) return false;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if ((ops[i]->Op == FWH_OP_ERASE) && !canEraseSectors(b, ops[i]->Start, ops[i]->Length)) return false;
+	}
+	return count > 0;
+}
+
+static bool overlap(const FwhOperation* o, unsigned long start, unsigned long end, unsigned long* from, unsigned long* to)
+{
+	*from = (o->Start > start) ? o->Start : start;
+	*to = (o->Start + o->Length < end) ? (o->Start + o->Length) : end;
+	return *from < *to;
+}
+
+typedef struct
+{
+	FwhOperation** Ops;
+	unsigned int Count;
+	bool Stopped[FWH_MAX_OPS]; //Failed or cut short, the sweep doesn't work on these any more
+	unsigned char* Target; //Program image of the current sector, 0xFF where there is nothing to program
+	bool* Have; //Target bytes that come from a program operation
+	unsigned char* Known; //Pre-read buffer
+	PlanStats Stats;
+} Plan;
+
+//Operations that have neither failed nor been cut short. Completed ones stay active, the sweep is past them anyway.
+static bool active(const Plan* p, unsigned int k)
+{
+	return !p->Stopped[k];
+}
+
+static void stopOp(Plan* p, unsigned int k, FwhError ret)
+{
+	p->Ops[k]->Result = ret;
+	p->Stopped[k] = true;
+}
+
+static void failOp(Plan* p, unsigned int k, FwhError ret, unsigned long addr)
+{
+	stopOp(p, k, ret);
+	p->Ops[k]->FailAddress = addr;
+}
+
+//True if the sector has to be erased to end up with the image (bytes without a target have to become 0xFF).
+//Unknown contents count as needing it: an erase is much cheaper than reading a sector over the bit-banged bus.
+static bool eraseNeeded(FwhBus* b, const Plan* p, unsigned long start, unsigned long size)
+{
+	unsigned char value;
+	for (unsigned long i = 0; i < size; i++)
+	{
+		if (!readbackGet(b, &value, start + i, 1)) return true;
+		if (p->Have[i] ? ((value & p->Target[i]) != p->Target[i]) : (value != 0xFF)) return true;
+	}
+	return false;
+}
+
+//Erases (if needed) and programs a sector. Fatal errors (bus, link) end the sweep: the operations being worked on
+//get the error, the rest stay FWH_ERR_NOT_RUN. If programming stops at a byte that didn't program (FWH_ERR_VERIFY,
+//FWH_ERR_TIMEOUT), the error is returned as well, and *done is set to that address: operations past it
+//are cut short, nothing from there on may be reported as done.
+static FwhError runSector(FwhBus* b, Plan* p, unsigned long start, unsigned long* done)
+{
+	unsigned long size = b->Device->SectorSize, end = start + size, from, to, addr, i;
+	unsigned int len = b->Config.BlockSize, k, eraseOp = p->Count;
+	bool erase = false, program = false;
+	FwhError ret;
+	*done = end;
+	memset(p->Target, 0xFF, size);
+	memset(p->Have, 0, size * sizeof(bool));
+	for (k = 0; k < p->Count; k++)
+	{
+		FwhOperation* o = p->Ops[k];
+		if (!active(p, k) || !overlap(o, start, end, &from, &to)) continue;
+		if (o->Op == FWH_OP_ERASE) eraseOp = k;
+		if (o->Op != FWH_OP_PROGRAM) continue;
+		memcpy(p->Target + (from - start), o->Data + (from - o->Start), to - from);
+		for (i = from; i < to; i++) p->Have[i - start] = true;
+		program = true;
+	}
+	if (eraseOp < p->Count)
+	{
+		if (eraseNeeded(b, p, start, size))
+		{
+			progress(b, FWH_OP_ERASE, start, start - p->Ops[eraseOp]->Start, p->Ops[eraseOp]->Length);
+			ret = eraseSector(b, start);
+			if (ret == FWH_OK)
+			{
+				erase = true;
+				p->Stats.Erased++;
+			}
+			else if (ret == FWH_ERR_TIMEOUT)
+			{
+				failOp(p, eraseOp, ret, start);
+			}
+			else
+			{
+				stopOp(p, eraseOp, ret);
+				return ret;
+			}
+		}
+		else
+		{
+			p->Stats.EraseSkipped++;
+		}
+	}
+	if (!program) return FWH_OK;
+	//Without an erase, the chip contents decide what has to be programmed: unknown bytes are read first
+	//(they would be read for verification anyway)
+	for (addr = start; !erase && (addr < end); addr += len)
+	{
+		if (!p->Have[addr - start] || readbackGet(b, p->Known, addr, len)) continue;
+		for (i = addr + len; (i < end) && p->Have[i - start] && !readbackGet(b, p->Known, i, len); i += len);
+		if ((ret = readExtent(b, FWH_OP_PROGRAM, addr, i - addr, p->Known)) != FWH_OK)
+		{
+			for (k = 0; k < p->Count; k++)
+			{
+				if ((p->Ops[k]->Op == FWH_OP_PROGRAM) && active(p, k) && overlap(p->Ops[k], start, end, &from, &to)) stopOp(p, k, ret);
+			}
+			return ret;
+		}
+		addr = i - len;
+	}
+	for (k = 0; k < p->Count; k++)
+	{
+		FwhOperation* o = p->Ops[k];
+		unsigned char value = 0xFF;
+		if ((o->Op != FWH_OP_PROGRAM) || !active(p, k) || !overlap(o, start, end, &from, &to)) continue;
+		for (addr = from; addr < to; addr++)
+		{
+			if (!erase && !readbackGet(b, &value, addr, 1)) value = 0xFF; //Unreadable map (out of memory): assume blank
+			if (p->Target[addr - start] == value)
+			{
+				p->Target[addr - start] = 0xFF;
+				p->Stats.ProgramSkipped++;
+			}
+			else if ((value & p->Target[addr - start]) != p->Target[addr - start])
+			{
+				report(b, FWH_LOG_ERROR, "Address %08lx has to be erased first (R:%02x F:%02x), use -e", addr, value, p->Target[addr - start]);
+				failOp(p, k, FWH_ERR_VERIFY, addr);
+				memset(p->Target + (from - start), 0xFF, to - from);
+				break;
+			}
+		}
+	}
+	for (i = 0; i < size; i++)
+	{
+		if (p->Target[i] != 0xFF) readbackForget(b, start + i, 1);
+	}
+	if (b->Remote) ret = remoteProgramExtent(b, FWH_OP_PROGRAM, start, size, p->Target);
+	else ret = programExtent(b, FWH_OP_PROGRAM, start, size, p->Target);
+	bool stopped = (ret == FWH_ERR_VERIFY) || (ret == FWH_ERR_TIMEOUT);
+	//Only what the engine got through counts as programmed: up to the failing byte, nothing after a bus or link failure
+	unsigned long through = (ret == FWH_OK) ? end : (stopped ? b->FailAddress : start);
+	for (addr = start; addr < through; addr++)
+	{
+		if (p->Target[addr - start] != 0xFF) p->Stats.Programmed++;
+	}
+	if (ret == FWH_OK) return FWH_OK;
+	//The engine programs in address order: operations that end before the failing byte are complete
+	for (k = 0; k < p->Count; k++)
+	{
+		FwhOperation* o = p->Ops[k];
+		if ((o->Op != FWH_OP_PROGRAM) || !active(p, k) || !overlap(o, start, end, &from, &to)) continue;
+		if (!stopped) stopOp(p, k, ret);
+		else if ((b->FailAddress >= from) && (b->FailAddress < to)) failOp(p, k, ret, b->FailAddress);
+		else if (from > b->FailAddress) stopOp(p, k, FWH_ERR_NOT_RUN);
+	}
+	if (stopped) *done = b->FailAddress;
+	return ret;
+}
+
+//Sectors covered by an erase operation are never pre-read
+static bool erased(FwhOperation** ops, unsigned int count, unsigned long start, unsigned long end)
+{
+	unsigned long from, to;
+	for (unsigned int k = 0; k < count; k++)
+	{
+		if ((ops[k]->Op == FWH_OP_ERASE) && overlap(ops[k], start, end, &from, &to)) return true;
+	}
+	return false;
+}
+
+//Worst case bus time of the batch, assuming bit-banged cycles (see lpc.c) and the slowest sector erase.
+//Bytes that are known already are counted as the fused sweep would skip them.
+static double estimateSeconds(FwhBus* b, FwhOperation** ops, unsigned int count, bool fused, PlanStats* est)
+{
+	const FwhDevice* dev = b->Device;
+	unsigned int len = b->Config.BlockSize, k;
+	unsigned long addr, sector, from, to, writes = dev->WriteOneshot ? (dev->WriteSCSCycles + 1u) : 1u;
+	unsigned char value;
+	memset(est, 0, sizeof(PlanStats));
+	for (k = 0; k < count; k++)
+	{
+		FwhOperation* o = ops[k];
+		switch (o->Op)
+		{
+			case FWH_OP_READ:
+				est->ReadCycles += o->Length / len;
+				break;
+			case FWH_OP_ERASE:
+				if (canEraseSectors(b, o->Start, o->Length))
+				{
+					est->Erased += o->Length / dev->SectorSize;
+					est->WriteCycles += (o->Length / dev->SectorSize) * (dev->EraseSCSCycles + 1u);
+				}
+				else
+				{
+					est->WriteCycles += (o->Length / len) * writes;
+					if (dev->WriteSCSCycles > 0) est->ReadCycles += 2 * (o->Length / len);
+				}
+				break;
+			case FWH_OP_PROGRAM:
+				//Erase coverage is looked up once per sector, not per byte
+				for (sector = o->Start - o->Start % dev->SectorSize; sector < o->Start + o->Length; sector += dev->SectorSize)
+				{
+					bool preRead = fused && !erased(ops, count, sector, sector + dev->SectorSize);
+					overlap(o, sector, sector + dev->SectorSize, &from, &to);
+					for (addr = from; addr < to; addr++)
+					{
+						bool known = readbackGet(b, &value, addr, 1);
+						if (preRead && !known && ((addr - o->Start) % len == 0)) est->ReadCycles++;
+						if (fused && known && (value == o->Data[addr - o->Start])) continue;
+						if ((o->Data[addr - o->Start] == 0xFF) && (dev->WriteSCSCycles > 0)) continue;
+						est->WriteCycles += writes;
+						if (dev->WriteSCSCycles > 0) est->ReadCycles += 2;
+					}
+				}
+				break;
+			default:
+				for (addr = o->Start; addr < o->Start + o->Length; addr += len)
+				{
+					if (!readbackGet(b, &value, addr, 1)) est->ReadCycles++;
+				}
+				break;
+		}
+	}
+	return (est->ReadCycles * (16.0 + 2 * len) * LPC_NIBBLE_US + est->WriteCycles * ((15.0 + 2 * len) * LPC_NIBBLE_US + LPC_WRITE_WAIT_US)
+		+ est->Erased * (double)SECTOR_ERASE_US) / 1e6;
+}
+
+//Sweeps the sectors touched by the operations in address order
+static FwhError runPlan(FwhBus* b, FwhOperation** ops, unsigned int count)
+{
+	unsigned long size = b->Device->SectorSize, first = ~0ul, last = 0, start, from, to, covered, done;
+	Plan p = { .Ops = ops, .Count = count };
+	struct timespec t0;
+	FwhError ret = FWH_OK, r;
+	unsigned int k;
+	p.Target = malloc(size);
+	p.Known = malloc(size);
+	p.Have = malloc(size * sizeof(bool));
+	if ((p.Target == NULL) || (p.Known == NULL) || (p.Have == NULL))
+	{
+		free(p.Target);
+		free(p.Known);
+		free(p.Have);
+		report(b, FWH_LOG_ERROR, "Out of memory");
+		for (k = 0; k < count; k++) ops[k]->Result = FWH_ERR_NO_MEMORY;
+		return FWH_ERR_NO_MEMORY;
+	}
+	for (k = 0; k < count; k++)
+	{
+		if (ops[k]->Start < first) first = ops[k]->Start;
+		if (ops[k]->Start + ops[k]->Length > last) last = ops[k]->Start + ops[k]->Length;
+	}
+	for (start = first - first % size; start < last; start += size)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		r = runSector(b, &p, start, &done);
+		if ((r == FWH_ERR_VERIFY) || (r == FWH_ERR_TIMEOUT)) r = FWH_OK; //Recorded in the operation, done tells how far it got
+		for (k = 0; (k < count) && (r == FWH_OK); k++)
+		{
+			FwhOperation* o = ops[k];
+			if (!active(&p, k) || (o->Op != FWH_OP_VERIFY) || !overlap(o, start, start + size, &from, &to)) continue;
+			r = verifyExtent(b, from, to - from, o->Data + (from - o->Start));
+			if (r == FWH_ERR_VERIFY)
+			{
+				failOp(&p, k, r, b->FailAddress);
+				r = FWH_OK;
+			}
+			else if (r != FWH_OK)
+			{
+				stopOp(&p, k, r);
+			}
+		}
+		double seconds = elapsedSince(&t0);
+		for (covered = 0, k = 0; k < count; k++)
+		{
+			if (overlap(ops[k], start, start + size, &from, &to)) covered += to - from;
+		}
+		for (k = 0; k < count; k++)
+		{
+			FwhOperation* o = ops[k];
+			if (!overlap(o, start, start + size, &from, &to)) continue;
+			o->Seconds += seconds * (to - from) / covered;
+			if (!active(&p, k) || (r != FWH_OK) || (o->Start + o->Length > start + size)) continue;
+			if ((o->Op != FWH_OP_PROGRAM) || (o->Start + o->Length <= done)) o->Result = FWH_OK;
+		}
+		if (r != FWH_OK)
+		{
+			ret = r;
+			break;
+		}
+	}
+	if (p.Stats.Erased + p.Stats.EraseSkipped + p.Stats.Programmed + p.Stats.ProgramSkipped > 0)
+	{
+		report(b, FWH_LOG_INFO, "Erased %lu sectors (%lu skipped), programmed 0x%lx bytes (0x%lx already matched).",
+			p.Stats.Erased, p.Stats.EraseSkipped, p.Stats.Programmed, p.Stats.ProgramSkipped);
+	}
+	reportKnown(b);
+	for (k = 0; (k < count) && (ret == FWH_OK); k++)
+	{
+		if (ops[k]->Result != FWH_OK) ret = ops[k]->Result;
+	}
+	free(p.Target);
+	free(p.Known);
+	free(p.Have);
+	return ret;
+}
+
+FwhError fwhExecute(FwhBus* b)
+{
+	FwhOperation* order[FWH_MAX_OPS];
+	FwhError ret = FWH_OK, r;
+	unsigned int i, j, n = 0, reads;
+	PlanStats est;
+	double seconds;
+	bool fused;
+	b->Executed = true;
+	if (b->OpCount == 0) return FWH_OK;
+	if ((r = fwhDetect(b, NULL)) != FWH_OK) return r;
+	//Lock stage: every block the batch touches is unlocked before any bus work, locked down ones fail right away
+	for (i = 0; i < b->OpCount; i++)
+	{
+		FwhOperation* o = &(b->Ops[i]);
+		o->Result = FWH_ERR_NOT_RUN;
+		o->Seconds = 0;
+		r = fwhUnlock(b, o->Start, o->Length, lockBits(o->Op));
+		if (r == FWH_ERR_LOCKED)
+		{
+			o->Result = r;
+			o->FailAddress = b->FailAddress;
+			if (ret == FWH_OK) ret = r;
+			continue;
+		}
+		if (r != FWH_OK) return restoreLocks(b, r);
+		order[n++] = o;
+	}
+	if (n == 0) return restoreLocks(b, ret);
+	qsort(order, n, sizeof(FwhOperation*), compareOps);
+	//Reads run first on their own (they see the chip as it was), the rest is one fused sweep where the device allows it
+	for (reads = 0; (reads < n) && (order[reads]->Op == FWH_OP_READ); reads++);
+	fused = canFuse(b, order + reads, n - reads);
+	seconds = estimateSeconds(b, order, n, fused, &est);
+	report(b, FWH_LOG_INFO, "Plan (%s): up to %lu read and %lu write cycles and %lu sector erases, estimated bus time %.1f s%s.",
+		fused ? "one fused sweep" : "separate passes", est.ReadCycles, est.WriteCycles, est.Erased, seconds,
+		b->Remote ? " (as bit-banged by the host, the coprocessor is faster)" : "");
+	for (i = 0; i < (fused ? reads : n); i = j)
+	{
+		//Each SCS is issued once per kind of operation
+		if ((i == 0) || (order[i]->Op != order[i - 1]->Op))
+		{
+			if ((r = executeSCS(b, (lockBits(order[i]->Op) & FWH_LOCK_WRITE) != 0)) != FWH_OK) return restoreLocks(b, r);
+		}
+		unsigned long end = order[i]->Start + order[i]->Length;
+		for (j = i + 1; (j < n) && (order[j]->Op == order[i]->Op) && (order[j]->Start == end); j++) end += order[j]->Length;
+		r = runOps(b, order + i, j - i);
+		if (ret == FWH_OK) ret = r;
+		//Bus and link failures leave the rest of the batch unusable
+		if ((r != FWH_OK) && (r != FWH_ERR_VERIFY) && (r != FWH_ERR_TIMEOUT)) return restoreLocks(b, ret);
+	}
+	if (fused)
+	{
+		r = runPlan(b, order + reads, n - reads);
+		if (ret == FWH_OK) ret = r;
+	}
+	return restoreLocks(b, ret);
+}
+
+unsigned int fwhResults(const FwhBus* b, const FwhOperation** ops)
+{
+	*ops = b->Ops;
+	return b->OpCount;
+}
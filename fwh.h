@@ -0,0 +1,140 @@
+#ifndef FWH_H
+#define FWH_H
+
+/*
+
+	libfwh: FWH flash programming without the command line tool.
+	Nothing in here prints or exits: calls return FwhError, messages and progress go to the callbacks.
+	The bus cycle layer (lpc.c) and the coprocessor link (remote.c) are single-instance, so only one bus can be open at a time.
+
+*/
+
+#include <stdbool.h>
+#include "gpio.h"
+
+#define FWH_MAX_OPS 256u //Batch size
+#define FWH_MAX_BLOCKS 16u //Lockable blocks (8 Mbit part with 64 KiB blocks)
+
+//Block locking register bits (FWH spec), write lock is set when the chip comes out of reset
+#define FWH_LOCK_WRITE 0x01u
+#define FWH_LOCK_DOWN 0x02u //Lock bits can't be changed until reset
+#define FWH_LOCK_READ 0x04u
+
+typedef enum
+{
+	FWH_OK,
+	FWH_ERR_BAD_ARG, //Unaligned or overlapping extents, bad block size, full batch
+	FWH_ERR_BUSY, //Another bus is open already
+	FWH_ERR_IO, //GPIO backend or coprocessor link couldn't be opened, or a GPIO access failed
+	FWH_ERR_NO_MEMORY,
+	FWH_ERR_BUS, //Bad SYNC/TAR from the chip
+	FWH_ERR_LINK, //Coprocessor reported a failure or went silent
+	FWH_ERR_UNSUPPORTED, //Unknown chip ID
+	FWH_ERR_TIMEOUT, //Program/erase didn't complete (locked block?)
+	FWH_ERR_LOCKED, //Block is locked down, lock bits can't be cleared until reset
+	FWH_ERR_VERIFY, //Chip contents don't match
+	FWH_ERR_NOT_RUN //Batch operation skipped because an earlier part of its run failed
+} FwhError;
+
+typedef enum
+{
+	FWH_LOG_INFO,
+	FWH_LOG_WARN,
+	FWH_LOG_ERROR,
+	FWH_LOG_DEBUG, //Bus cycle details, only with FwhConfig.Debug
+	FWH_LOG_STEP //Debug mode single-stepping: the bus waits until the callback returns
+} FwhLogLevel;
+
+typedef enum
+{
+	FWH_OP_READ,
+	FWH_OP_ERASE,
+	FWH_OP_PROGRAM,
+	FWH_OP_VERIFY
+} FwhOp;
+
+typedef void (*FwhLogCallback)(FwhLogLevel level, const char* text, void* ctx);
+//Called as bus work advances through an extent, addr is the next chip address to be processed
+typedef void (*FwhProgressCallback)(FwhOp op, unsigned long addr, unsigned long done, unsigned long total, void* ctx);
+
+typedef struct
+{
+	const GpioBackend* Gpio; //NULL selects wiringPi (the GPIO character device in NO_WIRINGPI builds)
+	const char* GpioDevice; //For backends that need one, NULL means /dev/gpiochip0
+	const char* RemotePort; //Offload bus cycles to a coprocessor (Gpio is not used then)
+	unsigned int BlockSize; //R/W block size, 0 means 1 (the only size 49lf004b and similar ones support)
+	bool Debug; //Verbose, single-stepped bus cycles (see lpc.c)
+	bool RestoreLocks; //Put back the block locks that were cleared for an operation/batch once it's done
+	FwhLogCallback Log;
+	FwhProgressCallback Progress;
+	void* Ctx; //Passed to the callbacks
+} FwhConfig;
+
+typedef struct
+{
+	const char* Name;
+	const unsigned char ManufacturerID;
+	const unsigned char ChipID;
+	const bool WriteOneshot;
+	const bool ReadOneshot;
+	const unsigned char WriteSCSCycles;
+	const unsigned char ReadSCSCycles;
+	const unsigned char* WriteCommand;
+	const unsigned long* WriteAddress;
+	const unsigned char* ReadCommand;
+	const unsigned long* ReadAddress;
+	const unsigned char EraseSCSCycles; //Followed by SectorEraseCommand written to the sector address
+	const unsigned char* EraseCommand;
+	const unsigned long* EraseAddress;
+	const unsigned char SectorEraseCommand;
+	const unsigned long SectorSize;
+	const unsigned long ChipSize; //Block locking registers are located relative to the top of the 4 GiB space
+	const unsigned long BlockSize; //Lockable block, 0 if the device has no block locking registers
+} FwhDevice;
+
+//Batch entry, results are filled in by fwhExecute()
+typedef struct
+{
+	FwhOp Op;
+	unsigned long Start;
+	unsigned long Length;
+	unsigned char* Data; //Destination for reads, image for program/verify, unused for erase
+	FwhError Result;
+	unsigned long FailAddress; //First failing chip address when Result is FWH_ERR_VERIFY/FWH_ERR_TIMEOUT
+	double Seconds; //Coalesced runs are apportioned by length
+} FwhOperation;
+
+typedef struct FwhBus FwhBus;
+
+FwhError fwhOpen(FwhBus** bus, const FwhConfig* config);
+void fwhClose(FwhBus* bus); //Releases the bus pins (chip is held in reset)
+const char* fwhErrorText(FwhError error);
+
+FwhError fwhReadIDs(FwhBus* bus, unsigned char* ids); //Manufacturer, chip
+FwhError fwhDetect(FwhBus* bus, const FwhDevice** device); //Reads the IDs and looks the chip up, forgets cached contents and locks
+unsigned long fwhFailAddress(const FwhBus* bus); //Of the last FWH_ERR_VERIFY/FWH_ERR_TIMEOUT/FWH_ERR_LOCKED
+
+//Block locks. All registers are read in one sweep and cached (until the next detection), so only the changes touch the bus afterwards.
+//Operations (single or batched) clear the locks of the blocks they touch: erase the write locks, reads and verifies
+//the read locks, program both (it reads the chip before and while programming).
+FwhError fwhReadLocks(FwhBus* bus, const unsigned char** locks, unsigned int* count); //One entry per block, FWH_LOCK_* bits
+FwhError fwhUnlock(FwhBus* bus, unsigned long start, unsigned long length, unsigned char bits);
+FwhError fwhRestoreLocks(FwhBus* bus); //Puts back everything fwhUnlock() has cleared since the last detection
+
+//Single operations. Start and length are chip addresses and have to be block-aligned.
+FwhError fwhRead(FwhBus* bus, unsigned long start, unsigned long length, unsigned char* data);
+FwhError fwhErase(FwhBus* bus, unsigned long start, unsigned long length);
+FwhError fwhProgram(FwhBus* bus, unsigned long start, unsigned long length, const unsigned char* image);
+FwhError fwhVerify(FwhBus* bus, unsigned long start, unsigned long length, const unsigned char* image);
+
+//Batch: reads are executed first (they see the chip as it was), then erase, program and verify are fused into one
+//sweep over the sectors where the device allows it: sectors are erased only if needed and unchanged bytes are not
+//programmed. Otherwise they run as separate passes, in that order, with adjacent extents of the same kind merged.
+//The chip is detected once per batch (nothing read by earlier batches is trusted), and the estimated bus time is
+//logged before starting.
+//Extents of the same kind must not overlap. Data buffers have to stay valid until fwhExecute() returns.
+FwhError fwhSubmit(FwhBus* bus, FwhOp op, unsigned long start, unsigned long length, unsigned char* data);
+FwhError fwhExecute(FwhBus* bus); //Returns the first failure, results stay available until the next fwhSubmit()
+unsigned int fwhResults(const FwhBus* bus, const FwhOperation** ops); //In submission order
+
+#endif
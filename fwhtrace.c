@@ -0,0 +1,219 @@
+/*
+
+	Offline decoder for bus traces recorded with "flasher -t".
+	Splits the nibble stream into FWH cycles (START, IDSEL, address, MSIZE, data, TAR, SYNC) and flags framing violations.
+	Build: gcc -O2 -o fwhtrace fwhtrace.c
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "trace.h"
+
+#define FWH_START_READ 0xDu
+#define FWH_START_WRITE 0xEu
+#define SYNC_SHORT_WAIT 0x5u
+#define SYNC_LONG_WAIT 0x6u
+#define NOTE_LEN 512u
+
+TraceEntry* entries;
+unsigned long count;
+unsigned long pos;
+double usPerTick;
+char note[NOTE_LEN]; //Violations found in the current cycle
+unsigned long violations = 0;
+
+void addNote(const char* text, const char* field, int nibble)
+{
+	size_t n = strlen(note);
+	if (nibble < 0) snprintf(note + n, NOTE_LEN - n, " [%s: %s]", field, text);
+	else snprintf(note + n, NOTE_LEN - n, " [%s: %s 0x%x]", field, text, nibble);
+}
+
+//Returns the next nibble of the current cycle, or -1 if the cycle ended prematurely (the nibble isn't consumed then).
+int take(bool out, const char* field)
+{
+	if (pos >= count)
+	{
+		addNote("trace ends", field, -1);
+		return -1;
+	}
+	if (entries[pos].Flags & TRACE_LFRAME)
+	{
+		addNote("aborted by LFRAME", field, -1);
+		return -1;
+	}
+	if (((entries[pos].Flags & TRACE_OUT) != 0) != out)
+	{
+		addNote(out ? "expected host to drive, but was sampled" : "expected to be sampled, but host drove", field, -1);
+	}
+	return entries[pos++].Nibble;
+}
+
+//SYNC may be preceded by wait states (0101 short, 0110 long)
+int takeSync(void)
+{
+	int d;
+	while ((d = take(false, "SYNC")) == SYNC_SHORT_WAIT || d == SYNC_LONG_WAIT);
+	if (d > 0) addNote("not ready", "SYNC", d);
+	return d;
+}
+
+unsigned int mSize2Len(int msize)
+{
+	switch (msize)
+	{
+		case 0: return 1;
+		case 1: return 2;
+		case 2: return 4;
+		case 4: return 16;
+		case 7: return 128;
+		default: return 0;
+	}
+}
+
+//Decodes a single cycle starting at an LFRAME nibble, returns false if it's malformed.
+bool decodeCycle(bool errorsOnly)
+{
+	unsigned long first = pos;
+	unsigned char start = entries[pos++].Nibble;
+	bool write = (start == FWH_START_WRITE);
+	unsigned long addr = 0;
+	unsigned char data[128];
+	unsigned int len = 0, got = 0, i;
+	int d, idsel = -1, msize = -1;
+
+	note[0] = 0;
+	if ((start != FWH_START_READ) && !write)
+	{
+		addNote("not an FWH cycle", "START", start);
+		goto finish;
+	}
+	if ((idsel = take(true, "IDSEL")) < 0) goto finish;
+	for (i = 0; i < 7; i++)
+	{
+		if ((d = take(true, "ADDR")) < 0) goto finish;
+		addr = (addr << 4) | d;
+	}
+	if ((msize = take(true, "MSIZE")) < 0) goto finish;
+	len = mSize2Len(msize);
+	if ((len == 0) || (write && (len > 4)))
+	{
+		addNote("unsupported", "MSIZE", msize);
+		goto finish;
+	}
+	if (write)
+	{
+		for (i = 0; i < len; i++)
+		{
+			int lo, hi;
+			if (((lo = take(true, "DATA")) < 0) || ((hi = take(true, "DATA")) < 0)) goto finish;
+			data[got++] = lo | (hi << 4);
+		}
+	}
+	if ((d = take(true, "TAR0")) < 0) goto finish;
+	if (d != 0xF) addNote("not 1111", "TAR0", d);
+	if (take(false, "TAR1") < 0) goto finish;
+	if (takeSync() != 0) goto finish;
+	if (!write)
+	{
+		for (i = 0; i < len; i++)
+		{
+			int lo, hi;
+			if (((lo = take(false, "DATA")) < 0) || ((hi = take(false, "DATA")) < 0)) goto finish;
+			data[got++] = lo | (hi << 4);
+		}
+	}
+	if ((d = take(false, "TAR0")) < 0) goto finish;
+	if ((d != 0xF) && write) addNote("not 1111", "TAR0", d);
+	take(false, "TAR1");
+
+finish:
+	//Anything clocked between the end of this cycle and the next START
+	for (i = 0; (pos < count) && !(entries[pos].Flags & TRACE_LFRAME); i++, pos++);
+	if (i > 0)
+	{
+		char text[32];
+		snprintf(text, sizeof(text), "%u nibbles", i);
+		addNote(text, "STRAY", -1);
+	}
+	bool ok = (note[0] == 0);
+	if (!ok) violations++;
+	if (ok && errorsOnly) return ok;
+	double t = (entries[first].Time - entries[0].Time) * usPerTick;
+	double duration = (entries[pos - 1].Time - entries[first].Time) * usPerTick;
+	printf("%14.1f us %9.1f us  %-5s", t, duration, write ? "WRITE" : ((start == FWH_START_READ) ? "READ" : "?"));
+	if (msize >= 0)
+	{
+		printf(" %07lx%s idsel %x msize %x ", addr, (addr & 0x400000) ? "" : " (register)", idsel, msize);
+	}
+	for (unsigned int j = 0; (j < got) && (j < 16); j++) printf(" %02x", data[j]);
+	if (got > 16) printf(" ...");
+	printf("%s\n", note);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	TraceHeader header;
+	bool errorsOnly = false;
+	const char* fileName = NULL;
+	unsigned long cycles = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-e") == 0) errorsOnly = true;
+		else fileName = argv[i];
+	}
+	if (fileName == NULL)
+	{
+		printf("FWH bus trace decoder\n");
+		printf("Usage: %s [-e] trace_file\n", argv[0]);
+		printf(" -e                Only print cycles with framing violations\n");
+		return 2;
+	}
+	FILE* f = fopen(fileName, "rb");
+	if (f == NULL)
+	{
+		printf("Can not open %s!\n", fileName);
+		return 2;
+	}
+	if ((fread(&header, sizeof(header), 1, f) != 1) || (memcmp(header.Magic, TRACE_MAGIC, 4) != 0) || (header.Version != TRACE_VERSION))
+	{
+		printf("Not a bus trace (or an incompatible version)!\n");
+		return 2;
+	}
+	count = header.Count;
+	entries = malloc(count * sizeof(TraceEntry) + 1);
+	if ((entries == NULL) || (fread(entries, sizeof(TraceEntry), count, f) != count))
+	{
+		printf("Trace is truncated!\n");
+		return 2;
+	}
+	fclose(f);
+	usPerTick = 1e6 / header.TicksPerSecond;
+	printf("%lu nibbles, %.0f ticks/s", count, header.TicksPerSecond);
+	if (header.Dropped > 0) printf(", %u older nibbles were overwritten", header.Dropped);
+	printf("\n%14s %12s  %-5s\n", "Time", "Duration", "Cycle");
+
+	//Skip to the first START, a wrapped ring usually begins mid-cycle
+	for (pos = 0; (pos < count) && !(entries[pos].Flags & TRACE_LFRAME); pos++);
+	if ((pos > 0) && (header.Dropped == 0))
+	{
+		printf("%lu nibbles were clocked before the first START!\n", pos);
+		violations++;
+	}
+	while (pos < count)
+	{
+		decodeCycle(errorsOnly);
+		cycles++;
+	}
+	if (count > 0)
+	{
+		printf("%lu cycles in %.1f ms, %lu with framing violations.\n", cycles, (entries[count - 1].Time - entries[0].Time) * usPerTick / 1000, violations);
+	}
+	free(entries);
+	return (violations > 0) ? 1 : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <stdbool.h>
+
+//Same values as wiringPi, so the bus code reads the same with any backend
+#ifndef LOW
+#define LOW 0
+#define HIGH 1
+#endif
+#ifndef INPUT
+#define INPUT 0
+#define OUTPUT 1
+#endif
+
+//BCM GPIO numbers: wiringPiSetupGpio() numbering, and line offsets of gpiochip0 on a Pi.
+typedef struct
+{
+	int Lad[4];
+	int Lframe;
+	int Lclk;
+	int Rst;
+	int Wr;
+} GpioPins;
+
+//Pin IO backend. Bus-wide operations (LAD + LFRAME, LAD direction) are separate entries,
+//so that backends capable of it can do them in a single access.
+//Accesses return false if they failed (the controller went away): the bus code turns that into FWH_ERR_IO.
+//Backends don't print, errno tells why Init() failed.
+typedef struct
+{
+	const char* Name;
+	bool (*Init)(const char* device, const GpioPins* pins);
+	void (*Close)(void);
+	bool (*PinMode)(int pin, int mode);
+	bool (*Write)(int pin, int value);
+	bool (*Read)(int pin, int* value);
+	bool (*LADMode)(int mode);
+	bool (*WriteLAD)(unsigned char data, int lframe); //LAD[3:0] and LFRAME at once
+	bool (*ReadLAD)(unsigned char* data);
+} GpioBackend;
+
+//Builds without wiringPi (non-Pi boards) define NO_WIRINGPI and leave gpio_wiringpi.c out
+#ifndef NO_WIRINGPI
+extern const GpioBackend WiringPiBackend; //gpio_wiringpi.c
+#endif
+extern const GpioBackend ChardevBackend; //gpio_chardev.c, Linux GPIO v2 uAPI (/dev/gpiochipN)
+
+#endif
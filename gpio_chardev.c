@@ -0,0 +1,184 @@
+/*
+
+	Linux GPIO character device backend (v2 uAPI, kernel 5.10+).
+	All bus lines are held by a single line request, so LAD[3:0] (+LFRAME) are written and read
+	with one GPIO_V2_LINE_SET_VALUES/GET_VALUES ioctl, and LAD direction is switched with one SET_CONFIG.
+	Works with gpio-sim too, which is handy for throughput measurements without hardware.
+
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "gpio.h"
+
+//Line order within the request: LAD0-3 occupy bits 0-3, so the nibble maps onto the bitmask directly.
+#define LINE_LFRAME 4
+#define LINE_LCLK 5
+#define LINE_RST 6
+#define LINE_WR 7
+#define LINE_NUMBER 8
+#define LAD_MASK 0x0Full
+
+static int lineFd = -1;
+static int offsets[LINE_NUMBER];
+static uint64_t outputMask = 0; //Lines configured as outputs
+static uint64_t values = 0; //Output latch (values written to input lines are applied when they become outputs)
+
+//Not a line of the request: reported like a failed ioctl
+static int lineIndex(int pin)
+{
+	for (int i = 0; i < LINE_NUMBER; i++)
+	{
+		if (offsets[i] == pin) return i;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static void fillConfig(struct gpio_v2_line_config* cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (outputMask == 0) return;
+	cfg->num_attrs = 2;
+	cfg->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	cfg->attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	cfg->attrs[0].mask = outputMask;
+	cfg->attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	cfg->attrs[1].attr.values = values;
+	cfg->attrs[1].mask = outputMask;
+}
+
+//Errors past a successful line request mean the chip went away, they are passed up (errno is left as the ioctl set it)
+static bool applyConfig(void)
+{
+	struct gpio_v2_line_config cfg;
+	fillConfig(&cfg);
+	return ioctl(lineFd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg) >= 0;
+}
+
+static bool setValues(uint64_t mask)
+{
+	struct gpio_v2_line_values v;
+	mask &= outputMask;
+	if (mask == 0) return true;
+	v.bits = values;
+	v.mask = mask;
+	return ioctl(lineFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) >= 0;
+}
+
+static bool getValues(uint64_t mask, uint64_t* bits)
+{
+	struct gpio_v2_line_values v;
+	v.bits = 0;
+	v.mask = mask;
+	if (ioctl(lineFd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0) return false;
+	*bits = v.bits;
+	return true;
+}
+
+static bool cdevInit(const char* device, const GpioPins* pins)
+{
+	struct gpio_v2_line_request req;
+	int chipFd, err;
+	if (device == NULL)
+	{
+		errno = EINVAL;
+		return false;
+	}
+	if ((chipFd = open(device, O_RDWR | O_CLOEXEC)) < 0) return false;
+	for (int i = 0; i < 4; i++) offsets[i] = pins->Lad[i];
+	offsets[LINE_LFRAME] = pins->Lframe;
+	offsets[LINE_LCLK] = pins->Lclk;
+	offsets[LINE_RST] = pins->Rst;
+	offsets[LINE_WR] = pins->Wr;
+	memset(&req, 0, sizeof(req));
+	for (int i = 0; i < LINE_NUMBER; i++) req.offsets[i] = offsets[i];
+	req.num_lines = LINE_NUMBER;
+	strncpy(req.consumer, "fwh-flasher", sizeof(req.consumer) - 1);
+	fillConfig(&req.config); //Everything starts as an input, like after wiringPiSetupGpio()
+	if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+	{
+		err = errno;
+		close(chipFd);
+		errno = err;
+		return false;
+	}
+	close(chipFd);
+	lineFd = req.fd;
+	return true;
+}
+
+static void cdevClose(void)
+{
+	if (lineFd != -1) close(lineFd); //Lines are released by the kernel
+	lineFd = -1;
+}
+
+static bool cdevPinMode(int pin, int mode)
+{
+	int i = lineIndex(pin);
+	if (i < 0) return false;
+	if (mode == OUTPUT) outputMask |= 1ull << i;
+	else outputMask &= ~(1ull << i);
+	return applyConfig();
+}
+
+static bool cdevWrite(int pin, int value)
+{
+	int i = lineIndex(pin);
+	if (i < 0) return false;
+	if (value) values |= 1ull << i;
+	else values &= ~(1ull << i);
+	return setValues(1ull << i);
+}
+
+static bool cdevRead(int pin, int* value)
+{
+	uint64_t bits;
+	int i = lineIndex(pin);
+	if ((i < 0) || !getValues(1ull << i, &bits)) return false;
+	*value = (bits & (1ull << i)) ? HIGH : LOW;
+	return true;
+}
+
+//Bus turnaround: one SET_CONFIG for all four lines
+static bool cdevLADMode(int mode)
+{
+	if (mode == OUTPUT) outputMask |= LAD_MASK;
+	else outputMask &= ~LAD_MASK;
+	return applyConfig();
+}
+
+static bool cdevWriteLAD(unsigned char data, int lframe)
+{
+	values &= ~(LAD_MASK | (1ull << LINE_LFRAME));
+	values |= (data & LAD_MASK) | ((lframe ? 1ull : 0) << LINE_LFRAME);
+	return setValues(LAD_MASK | (1ull << LINE_LFRAME));
+}
+
+static bool cdevReadLAD(unsigned char* data)
+{
+	uint64_t bits;
+	if (!getValues(LAD_MASK, &bits)) return false;
+	*data = bits & LAD_MASK;
+	return true;
+}
+
+const GpioBackend ChardevBackend =
+{
+	.Name = "gpiochip",
+	.Init = cdevInit,
+	.Close = cdevClose,
+	.PinMode = cdevPinMode,
+	.Write = cdevWrite,
+	.Read = cdevRead,
+	.LADMode = cdevLADMode,
+	.WriteLAD = cdevWriteLAD,
+	.ReadLAD = cdevReadLAD
+};
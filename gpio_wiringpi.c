@@ -0,0 +1,76 @@
+/*
+
+	wiringPi GPIO backend: one digitalWrite()/digitalRead() per pin.
+	wiringPi has no error reporting past setup (and exits by itself if that fails), so accesses always succeed.
+
+*/
+
+#include <wiringPi.h>
+#include "gpio.h"
+
+static GpioPins pins;
+
+static bool wpInit(const char* device, const GpioPins* p)
+{
+	(void)device;
+	pins = *p;
+	return wiringPiSetupGpio() != -1;
+}
+
+static void wpClose(void)
+{
+}
+
+static bool wpPinMode(int pin, int mode)
+{
+	pinMode(pin, mode);
+	return true;
+}
+
+static bool wpWrite(int pin, int value)
+{
+	digitalWrite(pin, value);
+	return true;
+}
+
+static bool wpRead(int pin, int* value)
+{
+	*value = digitalRead(pin);
+	return true;
+}
+
+static bool wpLADMode(int mode)
+{
+	for (int i = 0; i < 4; i++) pinMode(pins.Lad[i], mode);
+	return true;
+}
+
+static bool wpWriteLAD(unsigned char data, int lframe)
+{
+	for (int i = 0; i < 4; i++) digitalWrite(pins.Lad[i], (data >> i) & 0x1);
+	digitalWrite(pins.Lframe, lframe);
+	return true;
+}
+
+static bool wpReadLAD(unsigned char* data)
+{
+	*data = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (digitalRead(pins.Lad[i])) *data |= (1 << i);
+	}
+	return true;
+}
+
+const GpioBackend WiringPiBackend =
+{
+	.Name = "wiringPi",
+	.Init = wpInit,
+	.Close = wpClose,
+	.PinMode = wpPinMode,
+	.Write = wpWrite,
+	.Read = wpRead,
+	.LADMode = wpLADMode,
+	.WriteLAD = wpWriteLAD,
+	.ReadLAD = wpReadLAD
+};
@@ -0,0 +1,123 @@
+/*
+
+	GPIO backend throughput: times the backend calls the bus cycles are made of (LCLK edges, LAD+LFRAME writes,
+	LAD reads, bus turnarounds) without the cycle delays, i.e. the per-nibble cost the backend adds to the bus time.
+	Runs on the real pins (nothing is clocked into the chip while it is held in reset), or on gpio-sim:
+		modprobe gpio-sim
+		mkdir -p /sys/kernel/config/gpio-sim/fwh/bank0
+		echo 28 > /sys/kernel/config/gpio-sim/fwh/bank0/num_lines
+		echo 1 > /sys/kernel/config/gpio-sim/fwh/live
+		./gpiobench /dev/$(cat /sys/kernel/config/gpio-sim/fwh/bank0/chip_name)
+	Without a device the default backend is measured (wiringPi, unless built with -DNO_WIRINGPI).
+	Build: gcc -O2 -o gpiobench gpiobench.c lpc.c gpio_chardev.c gpio_wiringpi.c -lwiringPi
+	   or: gcc -O2 -DNO_WIRINGPI -o gpiobench gpiobench.c lpc.c gpio_chardev.c
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "lpc.h"
+
+#define DEFAULT_ROUNDS 100000ul
+
+typedef enum
+{
+	BENCH_WRITE, //Host-driven nibble: LCLK high, LAD+LFRAME, LCLK low (writeLAD() in lpc.c)
+	BENCH_READ, //Sampled nibble: LCLK high, LAD, LCLK low (readLAD() in lpc.c)
+	BENCH_TURNAROUND //LAD direction switch, there and back
+} BenchKind;
+
+double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Returns microseconds per round, or a negative value if an access failed
+double bench(BenchKind kind, unsigned long rounds)
+{
+	unsigned char data;
+	bool ok = true;
+	double t0 = now();
+	for (unsigned long i = 0; (i < rounds) && ok; i++)
+	{
+		switch (kind)
+		{
+			case BENCH_WRITE:
+				ok = lpcGpio->Write(lpcPins.Lclk, HIGH) && lpcGpio->WriteLAD(i & 0xF, (i & 0xF) ? HIGH : LOW) && lpcGpio->Write(lpcPins.Lclk, LOW);
+				break;
+			case BENCH_READ:
+				ok = lpcGpio->Write(lpcPins.Lclk, HIGH) && lpcGpio->ReadLAD(&data) && lpcGpio->Write(lpcPins.Lclk, LOW);
+				break;
+			case BENCH_TURNAROUND:
+				ok = lpcGpio->LADMode(INPUT) && lpcGpio->LADMode(OUTPUT);
+				break;
+		}
+	}
+	if (!ok) return -1;
+	return (now() - t0) * 1e6 / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long rounds = DEFAULT_ROUNDS;
+	const char* device = NULL;
+	double write, read, turn;
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) rounds = strtoul(argv[++i], NULL, 0);
+		else if (argv[i][0] != '-') device = argv[i];
+		else
+		{
+			printf("Usage: %s [-n rounds] [/dev/gpiochipN]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (rounds == 0) rounds = DEFAULT_ROUNDS;
+#ifdef NO_WIRINGPI
+	lpcGpio = &ChardevBackend;
+	if (device == NULL) device = "/dev/gpiochip0";
+#else
+	lpcGpio = (device != NULL) ? &ChardevBackend : &WiringPiBackend;
+#endif
+	errno = 0;
+	if (!lpcGpio->Init(device, &lpcPins))
+	{
+		printf("Can not initialize %s GPIO backend: %s!\n", lpcGpio->Name, errno ? strerror(errno) : "unknown error");
+		return 1;
+	}
+	//Chip in reset, bus lines driven like during a cycle
+	bool ok = lpcGpio->Write(lpcPins.Rst, LOW) && lpcGpio->PinMode(lpcPins.Rst, OUTPUT) && lpcGpio->Write(lpcPins.Lclk, LOW)
+		&& lpcGpio->PinMode(lpcPins.Lclk, OUTPUT) && lpcGpio->WriteLAD(0x0, HIGH) && lpcGpio->PinMode(lpcPins.Lframe, OUTPUT) && lpcGpio->LADMode(OUTPUT);
+	if (ok && ((write = bench(BENCH_WRITE, rounds)) >= 0) && ((turn = bench(BENCH_TURNAROUND, rounds)) >= 0))
+	{
+		ok = lpcGpio->LADMode(INPUT) && ((read = bench(BENCH_READ, rounds)) >= 0);
+	}
+	else
+	{
+		ok = false;
+	}
+	int err = errno;
+	lpcGpio->LADMode(INPUT);
+	lpcGpio->PinMode(lpcPins.Lframe, INPUT);
+	lpcGpio->PinMode(lpcPins.Lclk, INPUT);
+	if (!ok)
+	{
+		lpcGpio->Close();
+		printf("GPIO access failed: %s!\n", strerror(err));
+		return 1;
+	}
+	lpcGpio->Close();
+	printf("%s backend, %lu rounds each:\n", lpcGpio->Name, rounds);
+	printf("  host nibble (LCLK + LAD/LFRAME)  %8.3f us\n", write);
+	printf("  sampled nibble (LCLK + LAD)      %8.3f us\n", read);
+	printf("  LAD turnaround (both ways)       %8.3f us\n", turn);
+	//1-byte read: 11 host nibbles, 6 sampled ones (TAR1, SYNC, 2 data, TAR0, TAR1), turnaround there and back; write: 13 and 4
+	printf("GPIO time of a 1-byte read cycle: %.1f us, a 1-byte write cycle: %.1f us (on top of %u us of cycle delays per nibble).\n",
+		11 * write + 6 * read + turn, 13 * write + 4 * read + turn, LPC_NIBBLE_US);
+	return 0;
+}
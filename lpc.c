@@ -0,0 +1,331 @@
+/*
+
+	LPC/FWH bus cycles. Shared between the host tool and the coprocessor firmware,
+	so nothing here prints or exits: cycles return LpcStatus and callers decide, debug output goes to lpcDebug.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "lpc.h"
+
+//BCM GPIO numbers (header pins in the comments)
+const GpioPins lpcPins =
+{
+	.Lad = { 22, 23, 24, 25 }, //hd 15, 16, 18, 22
+	.Lframe = 27, //hd 13
+	.Lclk = 18, //hd 12
+	.Rst = 17, //hd 11
+	.Wr = 4 //hd 7
+};
+
+const GpioBackend* lpcGpio = NULL;
+bool lpcDebugMode = false;
+void (*lpcDebug)(const char* text) = NULL;
+bool lpcIoFailed = false;
+unsigned char lpcBadNibble = 0;
+TraceEntry* lpcTrace = NULL;
+uint64_t lpcTraceHead = 0;
+
+//Has to stay cheap enough to be left on for production runs: no branches besides the enable check, no IO.
+static inline void traceNibble(unsigned char data, unsigned char flags)
+{
+	if (lpcTrace)
+	{
+		TraceEntry* e = &lpcTrace[lpcTraceHead++ & (TRACE_RING_LEN - 1)];
+		e->Time = traceTicks();
+		e->Nibble = data;
+		e->Flags = flags;
+	}
+}
+
+//A failed access is remembered, the cycle is clocked through and returns LPC_ERR_IO
+static inline void check(bool ok)
+{
+	if (!ok) lpcIoFailed = true;
+}
+
+static inline LpcStatus status(LpcStatus ret)
+{
+	return lpcIoFailed ? LPC_ERR_IO : ret;
+}
+
+static void dbgPause(void)
+{
+	if (lpcDebugMode && (lpcDebug != NULL)) lpcDebug(NULL);
+}
+
+static void dbgPrint(const char* format, ...)
+{
+	char text[80];
+	va_list args;
+	if (!lpcDebugMode || (lpcDebug == NULL)) return;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	lpcDebug(text);
+}
+
+
+//LFRAME is always idle (high) when LAD gets zeroed out
+static void setLADOutputZ(bool zeroOut) {
+	if (zeroOut)
+	{
+		check(lpcGpio->WriteLAD(0x0, HIGH));
+		dbgPrint("LAD GPIO zeroed out.");
+	}
+	check(lpcGpio->LADMode(OUTPUT));
+	dbgPrint("LAD GPIO switched to OUTput.");
+	dbgPause();
+}
+
+static void setLADOutput(void)
+{
+	setLADOutputZ(false);
+}
+
+void lpcSetLADInputZ(bool zeroOut) {
+	check(lpcGpio->LADMode(INPUT));
+	dbgPrint("LAD GPIO switched to INput.");
+	if (zeroOut)
+	{
+		check(lpcGpio->WriteLAD(0x0, HIGH));
+		dbgPrint("LAD GPIO zeroed out.");
+	}
+	dbgPause();
+}
+
+static void setLADInput(void)
+{
+	lpcSetLADInputZ(false);
+}
+
+
+static void writeLAD(unsigned char data, unsigned char startFrame) {
+	//Data is latched on rising edge (clock has to be PCI-compliant). Timings should be well in-spec:
+	//LCLK minimum half-period is 11ns, while RPi is only capable of ~100nS minimum pulse width with wiringPi)
+	//Therefore I really don't understand why LCLK is driven high before the actual writing to LAD[3:0]
+	//But changing the order results in garbage being received (data stream gets shifted by a nibble and is misinterpreted).
+	check(lpcGpio->Write(lpcPins.Lclk, HIGH));
+	dbgPrint("Previous (?) LAD+LFRAME written, CLK high. Writing new (?) value: 0x%hhx", data);
+	dbgPause();
+	check(lpcGpio->WriteLAD(data & 0xF, startFrame ? LOW : HIGH));
+	traceNibble(data & 0xF, startFrame ? (TRACE_OUT | TRACE_LFRAME) : TRACE_OUT);
+	//My setup uses a breadboard and some long-ish wires, therefore I've uncommented all delays.
+	usleep(100);
+	check(lpcGpio->Write(lpcPins.Lclk, LOW));
+	usleep(100);
+}
+
+static unsigned char readLAD(void) {
+	unsigned char data = 0xF;
+	usleep(100);
+	check(lpcGpio->Write(lpcPins.Lclk, HIGH));
+	dbgPrint("Reading data: clock is high.");
+	dbgPause();
+	usleep(100);
+	check(lpcGpio->ReadLAD(&data));
+	traceNibble(data, 0);
+	dbgPrint("Read nibble: 0x%hhx", data);
+	check(lpcGpio->Write(lpcPins.Lclk, LOW));
+	return data;
+}
+
+void lpcEnableWrite(bool value)
+{
+	if (value)
+	{
+		check(lpcGpio->Write(lpcPins.Wr, LOW));
+	}
+	else
+	{
+		check(lpcGpio->Write(lpcPins.Wr, HIGH));
+	}
+}
+
+//Starts over after a failed access
+LpcStatus lpcPreparePins(void) {
+	lpcIoFailed = false;
+	check(lpcGpio->Write(lpcPins.Rst, LOW));
+	check(lpcGpio->Write(lpcPins.Lclk, LOW));
+	lpcEnableWrite(false);
+	check(lpcGpio->WriteLAD(0x0, HIGH));
+	dbgPrint("lpcPreparePins phase 1");
+	dbgPause();
+	setLADInput();
+	check(lpcGpio->PinMode(lpcPins.Rst, OUTPUT));
+	check(lpcGpio->PinMode(lpcPins.Wr, OUTPUT));
+	check(lpcGpio->PinMode(lpcPins.Lframe, OUTPUT));
+	check(lpcGpio->PinMode(lpcPins.Lclk, OUTPUT));
+	dbgPrint("lpcPreparePins phase 2");
+	dbgPause();
+	usleep(2000);
+	check(lpcGpio->Write(lpcPins.Rst, HIGH));
+	usleep(1000);
+	dbgPrint("lpcPreparePins finished. Reset is high.");
+	dbgPause();
+	return status(LPC_OK);
+}
+
+//According to SST49LF016C datasheet
+unsigned int lpcReadMSize(unsigned int len) {
+	switch(len) {
+		case 1: return 0;
+		case 2: return 1;
+		case 4: return 2;
+		case 16: return 4;
+		case 128: return 7;
+		default: return MSIZE_INVALID;
+	}
+}
+
+//According to SST49LF016C datasheet
+static unsigned int len2mSizeWrite(unsigned int len) {
+	switch(len) {
+		case 1: return 0;
+		case 2: return 1;
+		case 4: return 2;
+		default: return MSIZE_INVALID;
+	}
+}
+
+static void writeAddress(unsigned long startAddr)
+{
+	writeLAD((startAddr >> 24) & 0xF, 0);
+	writeLAD((startAddr >> 20) & 0xF, 0);
+	writeLAD((startAddr >> 16) & 0xF, 0);
+	writeLAD((startAddr >> 12) & 0xF, 0);
+	writeLAD((startAddr >> 8) & 0xF, 0);
+	writeLAD((startAddr >> 4) & 0xF, 0);
+	writeLAD((startAddr >> 0) & 0xF, 0);
+}
+
+//Should be suitable for all FWH chips now.
+//A bad RSYNC aborts the cycle, unless in debug mode (then the rest of the cycle is clocked through for inspection).
+LpcStatus lpcReadCycle(unsigned char *buffer, unsigned long startAddr, unsigned int len) {
+	LpcStatus ret = LPC_OK;
+	unsigned int msize = lpcReadMSize(len);
+	if (msize == MSIZE_INVALID) return LPC_ERR_MSIZE;
+	if (lpcIoFailed) return LPC_ERR_IO;
+	dbgPrint("Read cycle begins.");
+	unsigned int addr;
+	setLADOutput();
+	dbgPrint("Write start nibble.");
+	writeLAD(0x0d, 1); //Start mem read
+	dbgPrint("Write IDSEL.");
+	writeLAD(0x0, 0); //IDSEL=0000 (internally pulled low)
+	//7 Addr cycles
+	dbgPrint("Write address (7 nibbles).");
+	writeAddress(startAddr);
+	//MSIZE, 49lf004b and similar ones only support single-byte mode (0000).
+	dbgPrint("Write MSIZE.");
+	writeLAD(msize, 0);
+	//TAR0 "turnaround cycle" start (1111)
+	dbgPrint("Start turnaround cycle.");
+	writeLAD(0xF, 0);
+	lpcSetLADInputZ(true); //No clock here
+	//TAR1: Float to 1111: do not sample
+	usleep(100);
+	dbgPrint("Not a read: clock pulse for TAR1 float-to-1111 transition.");
+	readLAD();
+	usleep(100);
+	//RSYNC
+	dbgPrint("Reading RSYNC...");
+	unsigned char d = readLAD();
+	if(d != 0) {
+		lpcBadNibble = d;
+		if (!lpcDebugMode) return status(LPC_ERR_SYNC);
+		ret = LPC_ERR_SYNC;
+	}
+	//DATA fetching
+	for(addr = 0; addr < len; addr++) {
+		dbgPrint("Byte %u:", addr);
+		dbgPrint("Reading lower nibble...");
+		d = readLAD();
+		dbgPrint("Reading higher nibble...");
+		d |= readLAD() << 4;
+		buffer[addr] = d;
+	}
+	dbgPrint("Reading TAR0...");
+	if(((d = readLAD()) != 0xF) && (ret == LPC_OK)) {
+		lpcBadNibble = d;
+		ret = LPC_WARN_TAR;
+		//This is not critical, the chip holds the bus high only for 28nS, if I'm not mistaken.
+		//The value we read here is going to depend on stray capacitance and pin impedance.
+	}
+	//TAR1 - regain control over the bus.
+	dbgPrint("Not a read: clock pulse for TAR1 (regaining control)...");
+	readLAD();
+	return status(ret);
+}
+
+//Prepares the host-driven part of a write cycle, so it can be computed ahead of time (see lpcSendWrite()).
+LpcStatus lpcBuildWrite(LpcFrame* frame, const unsigned char *buffer, unsigned long startAddr, unsigned int len) {
+	unsigned int addr, n = 0;
+	unsigned int msize = len2mSizeWrite(len);
+	if (msize == MSIZE_INVALID) return LPC_ERR_MSIZE;
+	frame->Nibbles[n++] = 0x0e; //START (the only nibble sent with LFRAME low)
+	frame->Nibbles[n++] = 0x0; //IDSEL=0000 (internally pulled low)
+	//7 Addr cycles
+	for (int shift = 24; shift >= 0; shift -= 4) frame->Nibbles[n++] = (startAddr >> shift) & 0xF;
+	//MSIZE
+	frame->Nibbles[n++] = msize;
+	//Data
+	for(addr = 0; addr < len; addr++) {
+		frame->Nibbles[n++] = buffer[addr] & 0xF;
+		frame->Nibbles[n++] = (buffer[addr] >> 4) & 0xF;
+	}
+	//TAR0
+	frame->Nibbles[n++] = 0xF;
+	frame->Count = n;
+	return LPC_OK;
+}
+
+//Should be suitable for all FWH chips now.
+LpcStatus lpcWriteCycle(const unsigned char *buffer, unsigned long startAddr, unsigned int len) {
+	LpcFrame frame;
+	LpcStatus ret = lpcBuildWrite(&frame, buffer, startAddr, len);
+	if (ret != LPC_OK) return ret;
+	return lpcSendWrite(&frame);
+}
+
+LpcStatus lpcSendWrite(const LpcFrame* frame) {
+	unsigned char d;
+	if (lpcIoFailed) return LPC_ERR_IO;
+	setLADOutput();
+	writeLAD(frame->Nibbles[0], 1);
+	for (unsigned int i = 1; i < frame->Count; i++) writeLAD(frame->Nibbles[i], 0);
+	setLADInput();
+	usleep(LPC_WRITE_WAIT_US);
+	//TAR1
+	readLAD();
+	//RSYNC
+	if((d = readLAD()) != 0) {
+		lpcBadNibble = d;
+		return status(LPC_ERR_SYNC);
+	}
+	//TAR0
+	if((d = readLAD()) != 0xF) {
+		lpcBadNibble = d;
+		return status(LPC_ERR_TAR);
+	}
+	//TAR1
+	readLAD();
+	return status(LPC_OK);
+}
+
+//Data# polling: DQ7 reads inverted until a program/erase operation completes.
+//On LPC_OK value holds a read done after DQ7 had flipped, that is the final contents.
+LpcStatus lpcDataPoll(unsigned long addr, unsigned char expected, unsigned char* value, unsigned int limit) {
+	LpcStatus ret;
+	for (unsigned int i = 0; i < limit; i++) {
+		if ((ret = lpcReadCycle(value, addr, 1)) > LPC_WARN_TAR) return ret;
+		if (((*value ^ expected) & 0x80) == 0) {
+			//DQ7 may flip before the rest of the bits are valid, read again for the verdict
+			ret = lpcReadCycle(value, addr, 1);
+			return (ret > LPC_WARN_TAR) ? ret : LPC_OK;
+		}
+	}
+	return LPC_ERR_TIMEOUT;
+}
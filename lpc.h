@@ -0,0 +1,55 @@
+#ifndef LPC_H
+#define LPC_H
+
+#include <stdbool.h>
+#include "gpio.h"
+#include "trace.h"
+
+#define MAX_BLOCK_LEN 128u
+#define FLASH_SELECT_ADDR 0x400000 //Bit 22 directs reads to flash (not registers)
+#define MSIZE_INVALID 0xFFu
+#define MAX_WRITE_NIBBLES (2u + 7u + 1u + 2u * 4u + 1u) //START, IDSEL, address, MSIZE, 4 data bytes, TAR0
+#define POLL_LIMIT 10000u //Data# polling attempts before giving up (sector erase takes the longest)
+#define LPC_NIBBLE_US 200u //writeLAD()/readLAD() delays (lpc.c), for bus time estimates
+#define LPC_WRITE_WAIT_US 1000u //Between the host-driven part of a write cycle and its SYNC
+
+typedef enum
+{
+	LPC_OK,
+	LPC_WARN_TAR, //Read cycle completed, but TAR0 wasn't 1111 (not critical)
+	LPC_ERR_MSIZE, //Block length not supported, the bus wasn't touched
+	LPC_ERR_SYNC,
+	LPC_ERR_TAR,
+	LPC_ERR_TIMEOUT, //Data# polling didn't complete
+	LPC_ERR_IO //A GPIO backend access failed
+} LpcStatus;
+
+//Host-driven part of a write cycle
+typedef struct
+{
+	unsigned char Nibbles[MAX_WRITE_NIBBLES];
+	unsigned char Count;
+} LpcFrame;
+
+extern const GpioPins lpcPins;
+extern const GpioBackend* lpcGpio;
+extern bool lpcDebugMode; //Enables lpcDebug output
+//Debug mode output: a line of text, or (text is NULL) a request to wait for the user before the next bus step.
+//Nothing is printed without it.
+extern void (*lpcDebug)(const char* text);
+extern bool lpcIoFailed; //Sticky, set by a failed backend access, cleared by lpcPreparePins()
+extern unsigned char lpcBadNibble; //Offending nibble of the last cycle that didn't return LPC_OK
+extern TraceEntry* lpcTrace; //Bus trace ring (TRACE_RING_LEN entries), capture is off while NULL
+extern uint64_t lpcTraceHead; //Total nibbles captured (64-bit, a 32-bit count would wrap after days of capture), indexes the ring modulo its length
+
+void lpcSetLADInputZ(bool zeroOut);
+void lpcEnableWrite(bool value);
+LpcStatus lpcPreparePins(void);
+unsigned int lpcReadMSize(unsigned int len);
+LpcStatus lpcReadCycle(unsigned char *buffer, unsigned long startAddr, unsigned int len);
+LpcStatus lpcWriteCycle(const unsigned char *buffer, unsigned long startAddr, unsigned int len);
+LpcStatus lpcBuildWrite(LpcFrame* frame, const unsigned char *buffer, unsigned long startAddr, unsigned int len);
+LpcStatus lpcSendWrite(const LpcFrame* frame);
+LpcStatus lpcDataPoll(unsigned long addr, unsigned char expected, unsigned char* value, unsigned int limit);
+
+#endif
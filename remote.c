@@ -0,0 +1,502 @@
+/*
+
+	Host side of the coprocessor link: bus commands are packed into CRC-framed batches,
+	and up to REMOTE_WINDOW batches are kept in flight, so that the link never idles while the coprocessor works.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include "remote.h"
+
+#define MAX_RESENDS 8
+
+typedef struct
+{
+	unsigned char Op;
+	unsigned long Addr;
+	unsigned int Len;
+	RemoteSink Sink;
+	void* Ctx;
+	unsigned char* Value; //CMD_POLL result
+} PendingCommand;
+
+typedef struct
+{
+	unsigned int FrameLen; //Header + payload so far (CRC is appended when sent)
+	unsigned int ResultLen; //Expected result payload length
+	unsigned int CommandCount;
+	PendingCommand Commands[REMOTE_MAX_CMDS];
+	unsigned char Frame[LINK_MAX_FRAME];
+} Batch;
+
+static int portFd = -1;
+static Batch window[REMOTE_WINDOW + 1]; //Ring: batches in flight, followed by the one being filled
+static unsigned int oldest = 0;
+static unsigned int inFlight = 0;
+static unsigned char nextSeq = 0;
+static unsigned int resends = 0;
+static bool failed = false; //Link failure, sticky
+static unsigned char commandStatus = ST_OK; //First failed command since the last sync
+static unsigned char syncStatus = ST_OK; //Same, as returned by the last sync
+static bool resume = false; //The coprocessor skips commands until it gets CMD_RESUME
+static char errorText[128] = "";
+static unsigned long errorAddr = 0;
+
+static void fail(unsigned long addr, const char* format, ...)
+{
+	va_list args;
+	if (failed) return;
+	failed = true;
+	errorAddr = addr;
+	va_start(args, format);
+	vsnprintf(errorText, sizeof(errorText), format, args);
+	va_end(args);
+}
+
+static const char* statusText(unsigned char status)
+{
+	switch (status)
+	{
+		case ST_BUS: return "bus cycle failed";
+		case ST_TIMEOUT: return "polling timeout";
+		case ST_VERIFY: return "verify error";
+		case ST_BAD_CMD: return "bad command";
+		default: return "unknown status";
+	}
+}
+
+static Batch* filling(void)
+{
+	return &(window[(oldest + inFlight) % (REMOTE_WINDOW + 1)]);
+}
+
+static void resetBatch(Batch* b)
+{
+	b->FrameLen = LINK_HEADER_LEN;
+	b->ResultLen = 0;
+	b->CommandCount = 0;
+}
+
+static void put8(Batch* b, unsigned char v)
+{
+	b->Frame[b->FrameLen++] = v;
+}
+
+static void put16(Batch* b, unsigned int v)
+{
+	put8(b, v & 0xFF);
+	put8(b, (v >> 8) & 0xFF);
+}
+
+static void put32(Batch* b, unsigned long v)
+{
+	put16(b, v & 0xFFFF);
+	put16(b, (v >> 16) & 0xFFFF);
+}
+
+static void transmit(const unsigned char* data, unsigned int len)
+{
+	while (len > 0 && !failed)
+	{
+		ssize_t n = write(portFd, data, len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			fail(0, "link write failed: %s", strerror(errno));
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static bool receive(unsigned char* data, unsigned int len)
+{
+	struct pollfd p = { .fd = portFd, .events = POLLIN };
+	while (len > 0)
+	{
+		int r = poll(&p, 1, REMOTE_TIMEOUT_MS);
+		if (r == 0)
+		{
+			fail(0, "link timeout");
+			return false;
+		}
+		ssize_t n = (r > 0) ? read(portFd, data, len) : -1;
+		if (n <= 0)
+		{
+			if ((n < 0) && (errno == EINTR)) continue;
+			fail(0, "link read failed");
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+//Returns payload length
+static bool receiveFrame(unsigned char* frame, unsigned int* payloadLen)
+{
+	unsigned int len;
+	do
+	{
+		if (!receive(frame, 1)) return false;
+	} while (frame[0] != LINK_SOF);
+	if (!receive(frame + 1, LINK_HEADER_LEN - 1)) return false;
+	len = frame[3] | (frame[4] << 8);
+	if (len > LINK_MAX_PAYLOAD)
+	{
+		fail(0, "link framing error");
+		return false;
+	}
+	if (!receive(frame + LINK_HEADER_LEN, len + LINK_CRC_LEN)) return false;
+	uint16_t crc = linkCrc(0xFFFF, frame + 1, LINK_HEADER_LEN - 1 + len);
+	if ((frame[LINK_HEADER_LEN + len] != (crc & 0xFF)) || (frame[LINK_HEADER_LEN + len + 1] != (crc >> 8)))
+	{
+		//Results can't be requested again (the batch may have programmed something), so this is fatal.
+		fail(0, "corrupted result frame");
+		return false;
+	}
+	*payloadLen = len;
+	return true;
+}
+
+static void parseResults(Batch* b, const unsigned char* r, unsigned int len)
+{
+	unsigned int pos = 0;
+	for (unsigned int i = 0; (i < b->CommandCount) && !failed; i++)
+	{
+		PendingCommand* c = &(b->Commands[i]);
+		unsigned int need = 1;
+		if (c->Op == CMD_READ) need += c->Len;
+		else if (c->Op == CMD_PROGRAM) need += 2;
+		else if (c->Op == CMD_POLL) need += 1;
+		if (pos + need > len)
+		{
+			fail(c->Addr, "truncated result");
+			return;
+		}
+		if (r[pos] == ST_BAD_CMD)
+		{
+			fail(c->Addr, "%s at 0x%lx", statusText(r[pos]), c->Addr);
+			return;
+		}
+		//A failed command is reported by the next sync, the coprocessor skips everything after it
+		if ((r[pos] != ST_OK) && (r[pos] != ST_SKIPPED) && (commandStatus == ST_OK))
+		{
+			commandStatus = r[pos];
+			errorAddr = c->Addr;
+			if (c->Op == CMD_PROGRAM) errorAddr += r[pos + 1] | (r[pos + 2] << 8);
+			snprintf(errorText, sizeof(errorText), "%s", statusText(r[pos]));
+		}
+		if (r[pos] != ST_OK)
+		{
+			pos += need;
+			continue;
+		}
+		if ((c->Op == CMD_READ) && (c->Sink != NULL)) c->Sink(c->Addr, r + pos + 1, c->Len, c->Ctx);
+		if ((c->Op == CMD_POLL) && (c->Value != NULL)) *(c->Value) = r[pos + 1];
+		pos += need;
+	}
+}
+
+//Retires the oldest batch in flight (resending on NAKs)
+static void receiveResult(void)
+{
+	static unsigned char frame[LINK_MAX_FRAME];
+	unsigned int len;
+	while (!failed)
+	{
+		if (!receiveFrame(frame, &len)) return;
+		if (frame[2] == LINK_NAK)
+		{
+			//Go back N: resend everything in flight starting from the rejected batch
+			unsigned int i;
+			for (i = 0; i < inFlight; i++)
+			{
+				if (window[(oldest + i) % (REMOTE_WINDOW + 1)].Frame[1] == frame[1]) break;
+			}
+			if ((i == inFlight) || (++resends > MAX_RESENDS))
+			{
+				fail(0, "link is not recovering");
+				return;
+			}
+			for (; i < inFlight; i++)
+			{
+				Batch* b = &(window[(oldest + i) % (REMOTE_WINDOW + 1)]);
+				transmit(b->Frame, b->FrameLen + LINK_CRC_LEN);
+			}
+			continue;
+		}
+		Batch* b = &(window[oldest]);
+		if ((frame[2] != LINK_RESULT) || (frame[1] != b->Frame[1]))
+		{
+			fail(0, "unexpected frame from the coprocessor");
+			return;
+		}
+		resends = 0;
+		parseResults(b, frame + LINK_HEADER_LEN, len);
+		oldest = (oldest + 1) % (REMOTE_WINDOW + 1);
+		inFlight--;
+		return;
+	}
+}
+
+static void sendBatch(void)
+{
+	Batch* b = filling();
+	if (failed || (b->CommandCount == 0)) return;
+	if (inFlight == REMOTE_WINDOW) receiveResult();
+	if (failed) return;
+	unsigned int payload = b->FrameLen - LINK_HEADER_LEN;
+	b->Frame[0] = LINK_SOF;
+	b->Frame[1] = nextSeq++;
+	b->Frame[2] = LINK_BATCH;
+	b->Frame[3] = payload & 0xFF;
+	b->Frame[4] = payload >> 8;
+	uint16_t crc = linkCrc(0xFFFF, b->Frame + 1, b->FrameLen - 1);
+	b->Frame[b->FrameLen] = crc & 0xFF;
+	b->Frame[b->FrameLen + 1] = crc >> 8;
+	transmit(b->Frame, b->FrameLen + LINK_CRC_LEN);
+	inFlight++;
+	resetBatch(filling());
+}
+
+//Makes room for a command, returns NULL after a failure
+static PendingCommand* beginCommand(unsigned int argLen, unsigned int resultLen, Batch** batch)
+{
+	if (resume)
+	{
+		//First command after a sync that reported a failure: the coprocessor has skipped everything since
+		resume = false;
+		PendingCommand* r = beginCommand(1, 1, batch);
+		if (r == NULL) return NULL;
+		r->Op = CMD_RESUME;
+		put8(*batch, CMD_RESUME);
+	}
+	Batch* b = filling();
+	if ((b->CommandCount == REMOTE_MAX_CMDS) || (b->FrameLen + argLen > LINK_HEADER_LEN + LINK_MAX_PAYLOAD)
+		|| (b->ResultLen + resultLen > LINK_MAX_PAYLOAD))
+	{
+		sendBatch();
+		b = filling();
+	}
+	if (failed) return NULL;
+	b->ResultLen += resultLen;
+	PendingCommand* c = &(b->Commands[b->CommandCount++]);
+	memset(c, 0, sizeof(*c));
+	*batch = b;
+	return c;
+}
+
+//Starts a session: the coprocessor adopts our sequence numbers and drops anything left from a previous run
+static bool startSession(void)
+{
+	unsigned char frame[LINK_MAX_FRAME];
+	unsigned int len;
+	frame[0] = LINK_SOF;
+	frame[1] = nextSeq;
+	frame[2] = LINK_SYNC;
+	frame[3] = frame[4] = 0;
+	uint16_t crc = linkCrc(0xFFFF, frame + 1, LINK_HEADER_LEN - 1);
+	frame[5] = crc & 0xFF;
+	frame[6] = crc >> 8;
+	transmit(frame, LINK_HEADER_LEN + LINK_CRC_LEN);
+	//Stale results of an interrupted session may still be coming in
+	while (receiveFrame(frame, &len))
+	{
+		if ((frame[2] == LINK_SYNC) && (frame[1] == nextSeq)) return true;
+	}
+	return false;
+}
+
+static speed_t baudConstant(unsigned long baud)
+{
+	switch (baud)
+	{
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 921600: return B921600;
+		case 2000000: return B2000000;
+		case 4000000: return B4000000;
+		default: return B115200;
+	}
+}
+
+bool remoteOpen(const char* port)
+{
+	struct termios tty;
+	//Nothing of an earlier session carries over, failures included
+	failed = false;
+	commandStatus = syncStatus = ST_OK;
+	resume = false; //The SYNC ends the skipping as well
+	errorText[0] = 0;
+	errorAddr = 0;
+	resends = 0;
+	oldest = inFlight = 0;
+	resetBatch(filling());
+	portFd = open(port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (portFd < 0)
+	{
+		fail(0, "can't open %s: %s", port, strerror(errno));
+		return false;
+	}
+	//USB CDC links ignore the baud rate, it matters only for real UARTs
+	if (tcgetattr(portFd, &tty) == 0)
+	{
+		cfmakeraw(&tty);
+		cfsetspeed(&tty, baudConstant(REMOTE_BAUD));
+		tty.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(portFd, TCSANOW, &tty);
+		tcflush(portFd, TCIOFLUSH);
+	}
+	return startSession();
+}
+
+void remoteClose(void)
+{
+	if (portFd != -1) close(portFd);
+	portFd = -1;
+}
+
+bool remoteRead(unsigned long addr, unsigned long len, unsigned int block, RemoteSink sink, void* ctx)
+{
+	unsigned int chunk = REMOTE_CHUNK - (REMOTE_CHUNK % block);
+	for (unsigned long off = 0; off < len; off += chunk)
+	{
+		Batch* b;
+		unsigned int n = ((len - off) > chunk) ? chunk : (len - off);
+		PendingCommand* c = beginCommand(8, 1 + n, &b);
+		if (c == NULL) return false;
+		c->Op = CMD_READ;
+		c->Addr = addr + off;
+		c->Len = n;
+		c->Sink = sink;
+		c->Ctx = ctx;
+		put8(b, CMD_READ);
+		put32(b, addr + off);
+		put16(b, n);
+		put8(b, block);
+	}
+	return !failed;
+}
+
+bool remoteWrite(unsigned long addr, unsigned char data)
+{
+	Batch* b;
+	PendingCommand* c = beginCommand(6, 1, &b);
+	if (c == NULL) return false;
+	c->Op = CMD_WRITE;
+	c->Addr = addr;
+	put8(b, CMD_WRITE);
+	put32(b, addr);
+	put8(b, data);
+	return true;
+}
+
+bool remoteProgram(unsigned long addr, const unsigned char* data, unsigned long len)
+{
+	for (unsigned long off = 0; off < len; off += REMOTE_CHUNK)
+	{
+		Batch* b;
+		unsigned int n = ((len - off) > REMOTE_CHUNK) ? REMOTE_CHUNK : (len - off);
+		PendingCommand* c = beginCommand(7 + n, 3, &b);
+		if (c == NULL) return false;
+		c->Op = CMD_PROGRAM;
+		c->Addr = addr + off;
+		c->Len = n;
+		put8(b, CMD_PROGRAM);
+		put32(b, addr + off);
+		put16(b, n);
+		memcpy(b->Frame + b->FrameLen, data + off, n);
+		b->FrameLen += n;
+	}
+	return !failed;
+}
+
+bool remoteErase(unsigned long addr, unsigned char command)
+{
+	Batch* b;
+	PendingCommand* c = beginCommand(6, 1, &b);
+	if (c == NULL) return false;
+	c->Op = CMD_ERASE;
+	c->Addr = addr;
+	put8(b, CMD_ERASE);
+	put32(b, addr);
+	put8(b, command);
+	return true;
+}
+
+bool remotePoll(unsigned long addr, unsigned char expected, unsigned char* value)
+{
+	Batch* b;
+	PendingCommand* c = beginCommand(6, 2, &b);
+	if (c == NULL) return false;
+	c->Op = CMD_POLL;
+	c->Addr = addr;
+	c->Value = value;
+	put8(b, CMD_POLL);
+	put32(b, addr);
+	put8(b, expected);
+	return true;
+}
+
+bool remoteSetSCS(unsigned char kind, unsigned char count, const unsigned long* addr, const unsigned char* data)
+{
+	Batch* b;
+	if (count > SCS_MAX_CYCLES)
+	{
+		fail(0, "SCS is too long");
+		return false;
+	}
+	PendingCommand* c = beginCommand(3 + 5 * count, 1, &b);
+	if (c == NULL) return false;
+	c->Op = CMD_SET_SCS;
+	put8(b, CMD_SET_SCS);
+	put8(b, kind);
+	put8(b, count);
+	for (unsigned char i = 0; i < count; i++)
+	{
+		put32(b, addr[i]);
+		put8(b, data[i]);
+	}
+	return true;
+}
+
+bool remoteSync(void)
+{
+	sendBatch();
+	while ((inFlight > 0) && !failed) receiveResult();
+	syncStatus = commandStatus;
+	commandStatus = ST_OK;
+	if (syncStatus != ST_OK) resume = true;
+	return !failed && (syncStatus == ST_OK);
+}
+
+bool remoteLinkFailed(void)
+{
+	return failed;
+}
+
+unsigned char remoteCommandStatus(void)
+{
+	return syncStatus;
+}
+
+const char* remoteError(void)
+{
+	return errorText;
+}
+
+unsigned long remoteErrorAddress(void)
+{
+	return errorAddr;
+}
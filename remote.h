@@ -0,0 +1,34 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stdbool.h>
+#include "remote_proto.h"
+
+#define REMOTE_WINDOW 4u //Batches in flight
+#define REMOTE_MAX_CMDS 64u //Per batch
+#define REMOTE_CHUNK 256u //Extents are split into commands of this size
+#define REMOTE_TIMEOUT_MS 5000
+#define REMOTE_BAUD 921600
+
+//Called in submission order as results arrive
+typedef void (*RemoteSink)(unsigned long addr, const unsigned char* data, unsigned int len, void* ctx);
+
+//Commands are queued into batches, full batches are sent right away while up to REMOTE_WINDOW
+//of them await results. Link errors (framing, CRC, timeout, lost session) are sticky: everything else returns false
+//until remoteOpen(). A command that fails on the bus is reported by the next remoteSync(), nothing queued
+//after it up to that sync is executed.
+bool remoteOpen(const char* port);
+void remoteClose(void);
+bool remoteRead(unsigned long addr, unsigned long len, unsigned int block, RemoteSink sink, void* ctx);
+bool remoteWrite(unsigned long addr, unsigned char data);
+bool remoteProgram(unsigned long addr, const unsigned char* data, unsigned long len);
+bool remoteErase(unsigned long addr, unsigned char command);
+bool remotePoll(unsigned long addr, unsigned char expected, unsigned char* value);
+bool remoteSetSCS(unsigned char kind, unsigned char count, const unsigned long* addr, const unsigned char* data);
+bool remoteSync(void); //Sends the partial batch and waits for all results, false if the link or a command failed
+bool remoteLinkFailed(void);
+unsigned char remoteCommandStatus(void); //ST_* of the command that failed before the last remoteSync(), ST_OK if none
+const char* remoteError(void);
+unsigned long remoteErrorAddress(void); //Of the failed command (bus address), the failing byte for CMD_PROGRAM
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef REMOTE_PROTO_H
+#define REMOTE_PROTO_H
+
+/*
+
+	Host <-> coprocessor link protocol (see remote.c and firmware/coproc.c).
+	Frame: SOF, sequence, type, payload length (LE16), payload, CRC-16/CCITT (LE16) over everything but SOF.
+	A BATCH frame carries any number of commands, the RESULT frame with the same sequence number
+	carries their results in the same order. Multi-byte fields are little-endian.
+	The coprocessor executes batches strictly in sequence order. A corrupted or out-of-order batch is answered
+	with a single NAK carrying the expected sequence number, the host then resends everything from that batch on.
+	A session starts with a SYNC frame, which sets the expected sequence number and is echoed back.
+	A command that fails on the bus (ST_BUS, ST_TIMEOUT, ST_VERIFY) makes the coprocessor skip every command after it,
+	in the batches already in flight too, until a CMD_RESUME: nothing runs past a failing byte, just like on the host.
+
+*/
+
+#include <stdint.h>
+
+#define LINK_SOF 0xA5u
+#define LINK_HEADER_LEN 5u
+#define LINK_CRC_LEN 2u
+#define LINK_MAX_PAYLOAD 1024u
+#define LINK_MAX_FRAME (LINK_HEADER_LEN + LINK_MAX_PAYLOAD + LINK_CRC_LEN)
+
+//Frame types
+#define LINK_BATCH 0x01u //Host -> coprocessor
+#define LINK_RESULT 0x02u //Coprocessor -> host
+#define LINK_NAK 0x03u //Coprocessor -> host, no payload
+#define LINK_SYNC 0x04u //Host -> coprocessor and back, no payload
+
+//Commands (arguments -> results)
+#define CMD_READ 0x10u //addr32, count16, block8 -> status8, data[count] (always count bytes)
+#define CMD_WRITE 0x11u //addr32, data8 -> status8; a single raw write cycle
+#define CMD_PROGRAM 0x12u //addr32, count16, data[count] -> status8, done16; program SCS + data# polling per byte
+#define CMD_ERASE 0x13u //addr32, command8 -> status8; erase SCS + command at addr, then polling until erased
+#define CMD_POLL 0x14u //addr32, expected8 -> status8, value8; data# polling
+#define CMD_SET_SCS 0x15u //kind8, count8, {addr32, data8}[count] -> status8
+#define CMD_RESUME 0x16u //-> status8; ends the skipping after a failed command (a SYNC does as well)
+
+#define SCS_KIND_PROGRAM 0u
+#define SCS_KIND_ERASE 1u
+#define SCS_MAX_CYCLES 8u
+
+//Command status
+#define ST_OK 0u
+#define ST_BUS 1u //LPC cycle failed (bad SYNC/TAR)
+#define ST_TIMEOUT 2u //Polling didn't complete
+#define ST_VERIFY 3u //Polling completed, but the byte reads back wrong
+#define ST_BAD_CMD 4u //Unknown or malformed command, the rest of the batch is skipped
+#define ST_SKIPPED 5u //Not executed because an earlier command failed, results are padded to their usual length
+
+static inline uint16_t linkCrc(uint16_t crc, const unsigned char* data, unsigned int len)
+{
+	while (len--)
+	{
+		crc ^= (uint16_t)(*data++) << 8;
+		for (int i = 0; i < 8; i++) crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc;
+}
+
+#endif
@@ -0,0 +1,317 @@
+/*
+
+	Simulated SST49LF004B (see chipsim.h). LAD is sampled on every rising LCLK edge. writeLAD() in lpc.c raises LCLK before
+	it drives the new nibble, so the chip sees each host nibble one edge late, just like the real one.
+
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "chipsim.h"
+
+#define FLASH_SELECT 0x400000u
+#define MAX_CYCLE_NIBBLES (11u + 2u * 128u)
+#define PROGRAM_BUSY_READS 2 //Data# polling reads before a program completes
+#define ERASE_BUSY_READS 3
+
+static const unsigned long scsAddr[] = { 0x5555, 0x2AAA, 0x5555, 0x5555, 0x2AAA };
+static const unsigned char scsData[] = { 0xAA, 0x55, 0xA0, 0xAA, 0x55 }; //0x80 instead of 0xA0 for erase
+
+static GpioPins pins;
+static bool ladOut = false;
+static unsigned char lad = 0;
+static int lframe = HIGH;
+static int lclk = LOW;
+
+//What the tests set up and inspect, in shared memory after simShare()
+typedef struct
+{
+	unsigned char Memory[SIM_CHIP_SIZE];
+	unsigned char Locks[SIM_BLOCKS];
+	long StuckAddr;
+	long AccessesLeft;
+} Chip;
+
+static Chip ownChip = { .StuckAddr = -1, .AccessesLeft = -1 };
+static Chip* chip = &ownChip;
+
+static unsigned char cycle[MAX_CYCLE_NIBBLES]; //Nibbles of the cycle being received
+static unsigned int cycleLen = 0;
+static bool inCycle = false;
+static unsigned char response[2u + 2u * 128u]; //SYNC, data, TAR
+static unsigned int responseLen = 0, responsePos = 0;
+static int driven = -1; //Nibble the chip drives onto LAD, -1 while it doesn't
+
+static int scsStep = 0; //Command sequence progress: 1-3 program, 101-103 erase (after AA 55 80)
+static int busyReads = 0;
+static unsigned long busyAddr;
+static unsigned char busyData;
+
+int usleep(useconds_t us)
+{
+	(void)us;
+	return 0;
+}
+
+void simReset(void)
+{
+	memset(chip->Memory, 0xFF, sizeof(chip->Memory));
+	memset(chip->Locks, 0x01, sizeof(chip->Locks));
+	chip->StuckAddr = -1;
+	chip->AccessesLeft = -1;
+	inCycle = false;
+	responseLen = responsePos = 0;
+	driven = -1;
+	scsStep = 0;
+	busyReads = 0;
+}
+
+bool simShare(void)
+{
+	if (chip != &ownChip) return true;
+	Chip* shared = mmap(NULL, sizeof(Chip), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) return false;
+	*shared = *chip;
+	chip = shared;
+	return true;
+}
+
+unsigned char* simMemory(void)
+{
+	return chip->Memory;
+}
+
+void simSetLock(unsigned int block, unsigned char value)
+{
+	chip->Locks[block] = value;
+}
+
+unsigned char simLock(unsigned int block)
+{
+	return chip->Locks[block];
+}
+
+void simStuckBit(long addr)
+{
+	chip->StuckAddr = addr;
+}
+
+void simFailAfter(long accesses)
+{
+	chip->AccessesLeft = accesses;
+}
+
+static bool countAccess(void)
+{
+	if (chip->AccessesLeft < 0) return true;
+	if (chip->AccessesLeft == 0)
+	{
+		errno = EIO;
+		return false;
+	}
+	chip->AccessesLeft--;
+	return true;
+}
+
+//Flash (address bit 22 set) or registers: IDs and block locking registers
+static unsigned char readByte(unsigned long addr)
+{
+	unsigned int block = (addr >> 16) & 0xF;
+	if (addr & FLASH_SELECT)
+	{
+		unsigned long a = addr & (SIM_CHIP_SIZE - 1);
+		if ((busyReads > 0) && (a == busyAddr))
+		{
+			busyReads--;
+			return ~busyData & 0x80;
+		}
+		return (chip->Locks[a >> 16] & 0x04) ? 0x00 : chip->Memory[a]; //Read-locked blocks don't give their contents away
+	}
+	if ((addr & 0xFFFFF) == 0xC0000) return 0xBF;
+	if ((addr & 0xFFFFF) == 0xC0001) return 0x60;
+	if (((addr & 0xFFFF) == 0x0002) && (block >= 8)) return chip->Locks[block - 8];
+	return 0xFF;
+}
+
+static void writeByte(unsigned long addr, unsigned char data)
+{
+	unsigned long a = addr & (SIM_CHIP_SIZE - 1), low = addr & 0xFFFF;
+	unsigned int block = (addr >> 16) & 0xF;
+	bool writable = (addr & FLASH_SELECT) && !(chip->Locks[a >> 16] & 0x01);
+	//The command sequence cycles only decode A0-A15, so they count wherever they go
+	if (!(addr & FLASH_SELECT) && (low == 0x0002) && (block >= 8))
+	{
+		if (!(chip->Locks[block - 8] & 0x02)) chip->Locks[block - 8] = data & 0x07;
+		return;
+	}
+	if (scsStep == 3)
+	{
+		scsStep = 0;
+		if (!writable) return;
+		chip->Memory[a] &= ((long)a == chip->StuckAddr) ? (data | 0x01) : data;
+		busyReads = PROGRAM_BUSY_READS;
+		busyAddr = a;
+		busyData = data;
+		return;
+	}
+	if (scsStep == 103)
+	{
+		scsStep = 0;
+		if ((data != 0x30) || !writable) return;
+		memset(chip->Memory + (a & ~0xFFFul), 0xFF, 0x1000);
+		busyReads = ERASE_BUSY_READS;
+		busyAddr = a;
+		busyData = 0xFF;
+		return;
+	}
+	if (scsStep >= 101)
+	{
+		unsigned int i = scsStep - 101 + 3;
+		scsStep = ((low == scsAddr[i]) && (data == scsData[i])) ? (scsStep + 1) : 0;
+		return;
+	}
+	if ((scsStep == 2) && (low == 0x5555) && (data == 0x80))
+	{
+		scsStep = 101;
+		return;
+	}
+	scsStep = ((scsStep < 3) && (low == scsAddr[scsStep]) && (data == scsData[scsStep])) ? (scsStep + 1) : 0;
+}
+
+static unsigned int blockLength(unsigned char msize)
+{
+	switch (msize)
+	{
+		case 0: return 1;
+		case 1: return 2;
+		case 2: return 4;
+		case 4: return 16;
+		case 7: return 128;
+		default: return 1;
+	}
+}
+
+static void clockEdge(void)
+{
+	unsigned char nibble = ladOut ? lad : 0xF;
+	if (responseLen > 0)
+	{
+		if (responsePos < responseLen)
+		{
+			driven = response[responsePos++];
+		}
+		else
+		{
+			driven = -1;
+			responseLen = 0;
+			inCycle = false;
+		}
+		return;
+	}
+	if ((lframe == LOW) && ((nibble == 0xD) || (nibble == 0xE)))
+	{
+		inCycle = true;
+		cycleLen = 0;
+	}
+	if (!inCycle) return;
+	cycle[cycleLen++] = nibble;
+	if (cycleLen < 11) return;
+	unsigned int len = blockLength(cycle[9]), i;
+	unsigned long addr = 0;
+	for (i = 2; i < 9; i++) addr = (addr << 4) | cycle[i];
+	if ((cycle[0] == 0xD) && (cycleLen == 11))
+	{
+		response[0] = 0x0;
+		for (i = 0; i < len; i++)
+		{
+			unsigned char b = readByte(addr + i);
+			response[1 + 2 * i] = b & 0xF;
+			response[2 + 2 * i] = b >> 4;
+		}
+		response[1 + 2 * len] = 0xF;
+		responseLen = 2 + 2 * len;
+		responsePos = 0;
+	}
+	else if ((cycle[0] == 0xE) && (cycleLen == 11 + 2 * len))
+	{
+		for (i = 0; i < len; i++) writeByte(addr + i, cycle[10 + 2 * i] | (cycle[11 + 2 * i] << 4));
+		response[0] = 0x0;
+		response[1] = 0xF;
+		responseLen = 2;
+		responsePos = 0;
+	}
+	if (cycleLen == MAX_CYCLE_NIBBLES) inCycle = false;
+}
+
+static bool simInit(const char* device, const GpioPins* p)
+{
+	(void)device;
+	pins = *p;
+	return countAccess();
+}
+
+static void simClose(void)
+{
+}
+
+static bool simPinMode(int pin, int mode)
+{
+	(void)pin;
+	(void)mode;
+	return countAccess();
+}
+
+static bool simWrite(int pin, int value)
+{
+	if (!countAccess()) return false;
+	if ((pin == pins.Lclk) && value && !lclk) clockEdge();
+	if (pin == pins.Lclk) lclk = value;
+	return true;
+}
+
+static bool simRead(int pin, int* value)
+{
+	if (!countAccess()) return false;
+	*value = HIGH;
+	for (int i = 0; i < 4; i++)
+	{
+		if ((pin == pins.Lad[i]) && (driven >= 0)) *value = (driven >> i) & 1;
+	}
+	return true;
+}
+
+static bool simLADMode(int mode)
+{
+	ladOut = (mode == OUTPUT);
+	return countAccess();
+}
+
+static bool simWriteLAD(unsigned char data, int lf)
+{
+	lad = data & 0xF;
+	lframe = lf;
+	return countAccess();
+}
+
+//Undriven lines read as ones (pull-ups)
+static bool simReadLAD(unsigned char* data)
+{
+	if (!countAccess()) return false;
+	*data = (driven >= 0) ? driven : 0xF;
+	return true;
+}
+
+const GpioBackend SimBackend =
+{
+	.Name = "chipsim",
+	.Init = simInit,
+	.Close = simClose,
+	.PinMode = simPinMode,
+	.Write = simWrite,
+	.Read = simRead,
+	.LADMode = simLADMode,
+	.WriteLAD = simWriteLAD,
+	.ReadLAD = simReadLAD
+};
@@ -0,0 +1,28 @@
+#ifndef CHIPSIM_H
+#define CHIPSIM_H
+
+/*
+
+	Simulated SST49LF004B behind a GpioBackend: decodes the nibbles lpc.c clocks out, answers read cycles,
+	and runs the program/erase command sequences with data# polling. Test harness only.
+	Also replaces usleep(), so bus cycles run at CPU speed.
+
+*/
+
+#include <stdbool.h>
+#include "../gpio.h"
+
+#define SIM_CHIP_SIZE 0x80000u
+#define SIM_BLOCKS 8u
+
+extern const GpioBackend SimBackend;
+
+bool simShare(void); //Moves the chip into shared memory, so a process forked afterwards (linkemu.c) works on the same one
+void simReset(void); //Erased chip, all blocks write-locked (as after power-up), no faults
+unsigned char* simMemory(void); //SIM_CHIP_SIZE bytes, tests may preload or inspect it
+void simSetLock(unsigned int block, unsigned char value); //Block locking register
+unsigned char simLock(unsigned int block);
+void simStuckBit(long addr); //Bit 0 of this byte can't be programmed to 0 (worn cell), -1 for none
+void simFailAfter(long accesses); //Backend calls fail (EIO) after this many more, -1 for never
+
+#endif
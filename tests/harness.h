@@ -0,0 +1,81 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+/*
+
+	Minimal test harness shared by the test programs: CHECK() counts failures and carries on, runTests() runs
+	a table of cases and prints one line per case. Set TEST_VERBOSE to see the library log. Test harness only.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../fwh.h"
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+typedef struct
+{
+	const char* Name;
+	void (*Run)(void);
+} TestCase;
+
+static int failures = 0;
+static char logged[8192]; //Library messages since the bus was opened, for checks on the log (truncated when full)
+
+static void check(bool ok, const char* text, int line)
+{
+	if (ok) return;
+	printf("  line %d: %s failed\n", line, text);
+	failures++;
+}
+
+static void logMessage(FwhLogLevel level, const char* text, void* ctx)
+{
+	size_t used = strlen(logged);
+	(void)level;
+	(void)ctx;
+	snprintf(logged + used, sizeof(logged) - used, "%s\n", text);
+	if (getenv("TEST_VERBOSE") != NULL) printf("    %s\n", text);
+}
+
+static void fill(unsigned char* data, unsigned long len, unsigned int seed)
+{
+	srand(seed);
+	for (unsigned long i = 0; i < len; i++) data[i] = rand();
+}
+
+//Opens a bus with the test log attached and detects the chip right away
+static FwhBus* openTestBus(FwhConfig config)
+{
+	const FwhDevice* device;
+	FwhBus* bus = NULL;
+	config.Log = logMessage;
+	logged[0] = 0;
+	if (fwhOpen(&bus, &config) != FWH_OK) return NULL;
+	if (fwhDetect(bus, &device) == FWH_OK) return bus;
+	fwhClose(bus);
+	return NULL;
+}
+
+//Group is prefixed to the case names, NULL for none
+static void runTests(const char* group, const TestCase* tests, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int before = failures;
+		tests[i].Run();
+		printf("%s%s%s: %s\n", group ? group : "", group ? ": " : "", tests[i].Name, (failures == before) ? "ok" : "FAILED");
+	}
+}
+
+//Exit status of the test program
+static int testResult(void)
+{
+	if (failures > 0) printf("%d check(s) failed!\n", failures);
+	return (failures > 0) ? 1 : 0;
+}
+
+#endif
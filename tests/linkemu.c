@@ -0,0 +1,154 @@
+/*
+
+	Pty loopback coprocessor (see linkemu.h). The child is the board support of firmware/coproc.c:
+	linkGetc()/linkWrite() on the pty master, chipsim.c as its GPIO backend.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "../lpc.h"
+#include "../remote_proto.h"
+#include "chipsim.h"
+#include "linkemu.h"
+
+void coprocMain(void);
+int linkGetc(void);
+void linkWrite(const unsigned char* data, unsigned int len);
+
+typedef struct
+{
+	LinkEmuConfig Config;
+	LinkEmuStats Stats;
+} Shared;
+
+static Shared* shared = MAP_FAILED; //With the child
+static int masterFd = -1;
+static pid_t child = -1;
+static char portName[64];
+
+//The emulator follows the incoming frames on its own, the firmware doesn't know about it
+static unsigned char inHeader[LINK_HEADER_LEN];
+static unsigned int inPos = 0, inLen = 0;
+static unsigned char held[LINK_EMU_MAX_HELD * LINK_MAX_FRAME]; //Results held back (HoldResults)
+static unsigned int heldCount = 0;
+static unsigned int heldLen = 0;
+
+static void writeAll(const unsigned char* data, unsigned int len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(masterFd, data, len);
+		if (n <= 0) _exit(1);
+		data += n;
+		len -= n;
+	}
+}
+
+int linkGetc(void)
+{
+	unsigned char c;
+	if (read(masterFd, &c, 1) != 1) _exit(0);
+	if ((inPos == 0) && (c != LINK_SOF)) return c;
+	if (inPos < LINK_HEADER_LEN) inHeader[inPos] = c;
+	if (++inPos == LINK_HEADER_LEN)
+	{
+		inLen = LINK_HEADER_LEN + (inHeader[3] | (inHeader[4] << 8)) + LINK_CRC_LEN;
+		if (inHeader[2] == LINK_BATCH) shared->Stats.Batches++;
+	}
+	//First payload byte of the chosen batch
+	if ((inPos == LINK_HEADER_LEN + 1) && (inHeader[2] == LINK_BATCH) && (shared->Stats.Batches == shared->Config.CorruptBatch)) c ^= 0x01;
+	if ((inPos > LINK_HEADER_LEN) && (inPos == inLen)) inPos = 0;
+	return c;
+}
+
+void linkWrite(const unsigned char* data, unsigned int len)
+{
+	static unsigned char frame[LINK_MAX_FRAME];
+	LinkEmuStats* stats = &(shared->Stats);
+	if (data[2] == LINK_NAK) stats->Naks++;
+	if (data[2] != LINK_RESULT)
+	{
+		writeAll(data, len);
+		return;
+	}
+	memcpy(frame, data, len);
+	stats->Results++;
+	if ((stats->Results == shared->Config.CorruptResult) && (len > LINK_HEADER_LEN + LINK_CRC_LEN)) frame[LINK_HEADER_LEN] ^= 0x01;
+	if ((stats->Results < shared->Config.HoldResults) && (heldCount < LINK_EMU_MAX_HELD))
+	{
+		memcpy(held + heldLen, frame, len);
+		heldLen += len;
+		heldCount++;
+		return;
+	}
+	writeAll(held, heldLen);
+	heldLen = heldCount = 0;
+	writeAll(frame, len);
+}
+
+const char* linkEmuStart(const LinkEmuConfig* cfg)
+{
+	struct termios tty;
+	int slave;
+	shared = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) return NULL;
+	memset(shared, 0, sizeof(Shared));
+	shared->Config = *cfg;
+	//The chip is the caller's, to set up and inspect between operations
+	if (!simShare()) return NULL;
+	simReset();
+	masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((masterFd < 0) || (grantpt(masterFd) != 0) || (unlockpt(masterFd) != 0)) return NULL;
+	strncpy(portName, ptsname(masterFd), sizeof(portName) - 1);
+	//Raw mode from the start. The child keeps the slave open, so the pty survives the host closing and reopening it.
+	if ((slave = open(portName, O_RDWR | O_NOCTTY)) < 0) return NULL;
+	if (tcgetattr(slave, &tty) == 0)
+	{
+		cfmakeraw(&tty);
+		tcsetattr(slave, TCSANOW, &tty);
+	}
+	child = fork();
+	if (child == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		lpcGpio = &SimBackend;
+		lpcGpio->Init(NULL, &lpcPins);
+		coprocMain();
+		_exit(0);
+	}
+	close(slave);
+	return (child > 0) ? portName : NULL;
+}
+
+LinkEmuConfig* linkEmuConfig(void)
+{
+	return &(shared->Config);
+}
+
+const LinkEmuStats* linkEmuStats(void)
+{
+	return &(shared->Stats);
+}
+
+void linkEmuStop(void)
+{
+	if (child > 0)
+	{
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
+	child = -1;
+	if (masterFd != -1) close(masterFd);
+	masterFd = -1;
+	if (shared != MAP_FAILED) munmap(shared, sizeof(Shared));
+	shared = MAP_FAILED;
+}
@@ -0,0 +1,37 @@
+#ifndef LINKEMU_H
+#define LINKEMU_H
+
+/*
+
+	Pty loopback standing in for the coprocessor: a child process runs firmware/coproc.c on a simulated chip
+	(chipsim.c) behind the master side of a pty, the host opens the slave side as its serial port.
+	Frames can be corrupted on the way in either direction. Test harness only.
+
+*/
+
+//Frames are counted from the start of the emulator (see LinkEmuStats), 0 means none
+typedef struct
+{
+	unsigned int CorruptBatch; //Flip a payload bit of the n-th BATCH frame the coprocessor receives
+	unsigned int CorruptResult; //Same for the n-th RESULT frame it sends
+	unsigned int HoldResults; //Results before the n-th are held back and sent along with it (at most LINK_EMU_MAX_HELD)
+} LinkEmuConfig;
+
+#define LINK_EMU_MAX_HELD 8u
+
+//Counted by the coprocessor side
+typedef struct
+{
+	unsigned int Batches; //BATCH frames received, resends included
+	unsigned int Results;
+	unsigned int Naks;
+} LinkEmuStats;
+
+//Returns the port for FwhConfig.RemotePort, NULL on failure. Resets the simulated chip, which is shared
+//with the caller: simMemory() and the other chipsim.h calls work as with a local bus.
+const char* linkEmuStart(const LinkEmuConfig* config);
+LinkEmuConfig* linkEmuConfig(void); //Shared with the coprocessor, may be changed between operations
+const LinkEmuStats* linkEmuStats(void);
+void linkEmuStop(void);
+
+#endif
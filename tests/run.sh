@@ -0,0 +1,134 @@
+#!/bin/sh
+# Builds and runs the tests against a simulated chip (chipsim.c), no hardware needed.
+# Usage: tests/run.sh (TEST_VERBOSE=1 to see the library log and the flasher output)
+
+cd "$(dirname "$0")" || exit 2
+CC=${CC:-gcc}
+CFLAGS="-O2 -Wall -std=gnu99 -DNO_WIRINGPI"
+OUT=$(mktemp -d) || exit 2
+trap 'rm -rf "$OUT"' EXIT
+
+$CC $CFLAGS -o "$OUT/test_fwh" test_fwh.c linkemu.c chipsim.c ../fwh.c ../lpc.c ../remote.c ../gpio_chardev.c ../firmware/coproc.c || exit 2
+$CC $CFLAGS -o "$OUT/test_link" test_link.c linkemu.c chipsim.c ../fwh.c ../lpc.c ../remote.c ../gpio_chardev.c ../firmware/coproc.c || exit 2
+# The flasher itself, with the simulated chip standing in for the GPIO character device and kept in $SIM_IMAGE (simimage.c)
+$CC $CFLAGS -DChardevBackend=SimBackend -o "$OUT/flasher" ../flasher.c simimage.c chipsim.c ../fwh.c ../lpc.c ../remote.c -lz || exit 2
+
+status=0
+for t in test_fwh test_link; do
+	echo "== $t"
+	"$OUT/$t" || status=1
+done
+
+# Flasher cases print the failed checks, then "<name>: ok" or "<name>: FAILED" like the test programs
+CHIP="$OUT/chip.bin"
+failed=0
+
+fail()
+{
+	echo "  $1"
+	failed=1
+}
+
+# flash <expected exit status> <flasher arguments>, the output goes to $OUT/log
+flash()
+{
+	expected=$1
+	shift
+	SIM_IMAGE="$CHIP" "$OUT/flasher" "$@" >"$OUT/log" 2>&1 </dev/null
+	got=$?
+	[ $got -eq "$expected" ] || fail "flasher $*: exit status $got, expected $expected"
+	[ -z "$TEST_VERBOSE" ] || sed 's/^/    /' "$OUT/log"
+}
+
+expectLog()
+{
+	grep -q -- "$1" "$OUT/log" || fail "not in the output: $1"
+}
+
+# same <file> <offset> <length> <file> <offset>: compares two byte ranges
+same()
+{
+	dd if="$1" of="$OUT/a" bs=1 skip="$2" count="$3" 2>/dev/null
+	dd if="$4" of="$OUT/b" bs=1 skip="$5" count="$3" 2>/dev/null
+	cmp -s "$OUT/a" "$OUT/b" || fail "$1 at $2 differs from $4 at $5 ($3 bytes)"
+}
+
+caseDone()
+{
+	if [ $failed -eq 0 ]; then echo "$1: ok"; else echo "$1: FAILED"; status=1; fi
+	failed=0
+}
+
+# Chip contents: data, a zero run of 0x60000 bytes, data
+newChip()
+{
+	{ head -c 65536 /dev/urandom; head -c 393216 /dev/zero; head -c 65536 /dev/urandom; } >"$CHIP"
+}
+
+echo "== flasher"
+
+# Sparse dump into an existing file: the zero run becomes a hole, old contents there are punched out
+newChip
+head -c 524288 /dev/urandom >"$OUT/sparse.bin"
+flash 0 -m -r -p -s 0 -l 80000 -f "$OUT/sparse.bin"
+cmp -s "$OUT/sparse.bin" "$CHIP" || fail "sparse dump differs from the chip"
+# Only the two 64 KiB data runs take blocks (plus some slack for the filesystem)
+allocated=$(($(stat -c "%b * %B" "$OUT/sparse.bin")))
+[ $allocated -le $((0x20000 + 0x4000)) ] || fail "sparse dump takes $allocated bytes, the zero run isn't a hole"
+caseDone "sparse dump"
+
+flash 0 -m -r -z -s 0 -l 80000 -f "$OUT/dump.gz"
+zcat "$OUT/dump.gz" | cmp -s - "$CHIP" || fail "gzip dump differs from the chip"
+caseDone "gzip dump"
+
+# Job file parsing: comments and empty lines are skipped, anything malformed stops before the bus is opened
+newChip
+cp "$CHIP" "$OUT/before.bin"
+printf '# comment\n\nr 0 100 0\nx 100 100 100\n' >"$OUT/jobs"
+flash 2 -j "$OUT/jobs" -f "$OUT/out.bin"
+expectLog "Bad job at line 4: x 100 100 100"
+printf 'r 0 0 0\n' >"$OUT/jobs"
+flash 2 -j "$OUT/jobs" -f "$OUT/out.bin"
+expectLog "Bad job at line 1"
+printf 'r 0 100\n' >"$OUT/jobs"
+for i in $(seq 1 64); do printf 'r %x 1 %x\n' $((0x1000 + i)) $((0x100 + i)); done >>"$OUT/jobs"
+flash 2 -j "$OUT/jobs" -f "$OUT/out.bin"
+expectLog "Too many jobs, maximum is 64!"
+cmp -s "$CHIP" "$OUT/before.bin" || fail "the chip was changed"
+caseDone "job file parsing"
+
+# Overlaps: the same op in chip address space, reads against anything else that uses the file
+head -c 1024 /dev/urandom >"$OUT/data.bin"
+printf 'w 10000 200 0\ne 10000 1000\nw 10100 100 200\n' >"$OUT/jobs"
+flash 2 -j "$OUT/jobs" -f "$OUT/data.bin"
+expectLog "Jobs 0 and 2 overlap in chip address space!"
+printf 'v 20000 100 0\nr 30000 100 80\n' >"$OUT/jobs"
+flash 2 -j "$OUT/jobs" -f "$OUT/data.bin"
+expectLog "Jobs 0 and 1 overlap in the file!"
+cmp -s "$CHIP" "$OUT/before.bin" || fail "the chip was changed"
+caseDone "job overlaps"
+
+# Listed in reverse, run as read, erase, write, verify: the read still sees the old (zero) contents
+head -c 768 /dev/urandom >"$OUT/data.bin"
+cp "$OUT/data.bin" "$OUT/image.bin"
+head -c 3840 /dev/zero | tr '\0' '\377' >"$OUT/erased"
+printf 'v 21000 100 100\nw 21000 100 100\ne 21000 1000\nr 21000 100 200\n' >"$OUT/jobs"
+flash 0 -j "$OUT/jobs" -f "$OUT/data.bin"
+same "$CHIP" $((0x21000)) 256 "$OUT/image.bin" 256
+same "$CHIP" $((0x21100)) 3840 "$OUT/erased" 0
+same "$OUT/data.bin" 512 256 /dev/zero 0
+expectLog "v   00021000  00000100  00000100  OK"
+expectLog "w   00021000  00000100  00000100  OK"
+expectLog "e   00021000  00001000  00000000  OK"
+expectLog "r   00021000  00000100  00000200  OK"
+caseDone "job order"
+
+# A failing job shows in its row of the results table and in the exit status, the others still run
+printf 'v 30000 100 0\nr 40000 100 300\n' >"$OUT/jobs"
+flash 1 -j "$OUT/jobs" -f "$OUT/data.bin"
+expectLog "v   00030000  00000100  00000000  Verify error"
+expectLog "r   00040000  00000100  00000300  OK"
+same "$OUT/data.bin" 768 256 /dev/zero 0
+caseDone "job results"
+
+exit $status
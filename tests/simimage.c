@@ -0,0 +1,35 @@
+/*
+
+	Keeps the simulated chip (chipsim.c) in a file between runs of a program linked with it, so tests/run.sh can
+	drive the flasher itself: the chip is loaded from $SIM_IMAGE at startup (erased if the file doesn't exist yet)
+	and saved back on exit. Test harness only.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "chipsim.h"
+
+static const char* imageName = NULL;
+
+static void saveImage(void)
+{
+	FILE* f = fopen(imageName, "wb");
+	if (f == NULL) return;
+	if (fwrite(simMemory(), 1, SIM_CHIP_SIZE, f) != SIM_CHIP_SIZE) fprintf(stderr, "Can not save %s!\n", imageName);
+	fclose(f);
+}
+
+__attribute__((constructor)) static void loadImage(void)
+{
+	FILE* f;
+	simReset();
+	imageName = getenv("SIM_IMAGE");
+	if (imageName == NULL) return;
+	if ((f = fopen(imageName, "rb")) != NULL)
+	{
+		if (fread(simMemory(), 1, SIM_CHIP_SIZE, f) != SIM_CHIP_SIZE) fprintf(stderr, "Short chip image %s!\n", imageName);
+		fclose(f);
+	}
+	atexit(saveImage);
+}
@@ -0,0 +1,209 @@
+/*
+
+	Batch result codes: fwhSubmit()/fwhExecute() on the simulated chip (chipsim.c), including partial failures.
+	The same cases run behind the bit-banged bus and behind the coprocessor (linkemu.c), the codes mustn't
+	depend on the backend.
+
+*/
+
+#include <string.h>
+#include "harness.h"
+#include "chipsim.h"
+#include "linkemu.h"
+
+static const char* remotePort = NULL; //Coprocessor cases, NULL for the bit-banged bus
+
+//Fresh chip (erased, write-locked) for every test
+static FwhBus* openSim(void)
+{
+	FwhConfig config = { .Gpio = &SimBackend, .RemotePort = remotePort };
+	simReset();
+	return openTestBus(config);
+}
+
+static void testAllOk(void)
+{
+	static unsigned char image[0x2000], data[0x100];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 1);
+	memset(simMemory() + 0x30000, 0x5A, sizeof(data));
+	CHECK(fwhSubmit(bus, FWH_OP_READ, 0x30000, sizeof(data), data) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_VERIFY, 0x10000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_OK);
+	CHECK(fwhResults(bus, &ops) == 3);
+	for (unsigned int i = 0; i < 3; i++) CHECK(ops[i].Result == FWH_OK);
+	CHECK(data[0] == 0x5A && data[sizeof(data) - 1] == 0x5A);
+	CHECK(memcmp(simMemory() + 0x10000, image, sizeof(image)) == 0);
+	fwhClose(bus);
+}
+
+//A worn bit in the second of three program ops sharing a sector: the ops before it are done, the one that contains it
+//fails at the byte, the one after it (same sector) is never started, and the next sector is programmed as usual
+static void testPartialFailure(void)
+{
+	static unsigned char image[0x400];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 2);
+	image[0x50] = 0x00;
+	simStuckBit(0x250);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x100, 0x100, image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x200, 0x100, image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x300, 0x100, image + 0x100) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x1000, 0x100, image + 0x200) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_ERR_VERIFY);
+	CHECK(fwhResults(bus, &ops) == 4);
+	CHECK(ops[0].Result == FWH_OK);
+	CHECK(ops[1].Result == FWH_ERR_VERIFY);
+	CHECK(ops[1].FailAddress == 0x250);
+	CHECK(ops[2].Result == FWH_ERR_NOT_RUN);
+	CHECK(ops[3].Result == FWH_OK);
+	CHECK(memcmp(simMemory() + 0x100, image, 0x100) == 0);
+	CHECK(simMemory()[0x300] == 0xFF && simMemory()[0x3FF] == 0xFF);
+	CHECK(memcmp(simMemory() + 0x1000, image + 0x200, 0x100) == 0);
+	//Up to the worn byte and the next sector, bytes that were 0xFF in the image needed no programming
+	unsigned int programmed = 0;
+	char text[64];
+	for (unsigned int i = 0; i < 0x150; i++) programmed += (image[i] != 0xFF);
+	for (unsigned int i = 0x200; i < 0x300; i++) programmed += (image[i] != 0xFF);
+	snprintf(text, sizeof(text), "programmed 0x%x bytes", programmed);
+	CHECK(strstr(logged, text) != NULL);
+	fwhClose(bus);
+}
+
+//A byte that needs an erase fails its op before anything is written, and the summary doesn't count it
+static void testNeedsErase(void)
+{
+	static unsigned char image[0x10];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	memset(image, 0x12, sizeof(image));
+	simMemory()[0x10008] = 0x00;
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_ERR_VERIFY);
+	CHECK(fwhResults(bus, &ops) == 1);
+	CHECK(ops[0].Result == FWH_ERR_VERIFY);
+	CHECK(ops[0].FailAddress == 0x10008);
+	CHECK(simMemory()[0x10000] == 0xFF);
+	const char* summary = strstr(logged, "programmed 0x");
+	CHECK((summary == NULL) || (strncmp(summary, "programmed 0x0 ", 15) == 0));
+	fwhClose(bus);
+}
+
+//Lock bits of a locked-down block can't be cleared, so its op fails before any bus work, the others still run
+static void testLockedDown(void)
+{
+	static unsigned char image[0x100];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 3);
+	simSetLock(2, FWH_LOCK_WRITE | FWH_LOCK_DOWN);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x20000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x40000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_ERR_LOCKED);
+	CHECK(fwhResults(bus, &ops) == 2);
+	CHECK(ops[0].Result == FWH_ERR_LOCKED);
+	CHECK(ops[1].Result == FWH_OK);
+	CHECK(simMemory()[0x20000] == 0xFF);
+	CHECK(memcmp(simMemory() + 0x40000, image, sizeof(image)) == 0);
+	fwhClose(bus);
+}
+
+//A failing GPIO access surfaces as FWH_ERR_IO, nothing is reported as done
+static void testGpioFailure(void)
+{
+	static unsigned char image[0x1000];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 4);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_VERIFY, 0x10000, sizeof(image), image) == FWH_OK);
+	simFailAfter(20000);
+	CHECK(fwhExecute(bus) == FWH_ERR_IO);
+	CHECK(fwhResults(bus, &ops) == 2);
+	for (unsigned int i = 0; i < 2; i++) CHECK(ops[i].Result != FWH_OK);
+	simFailAfter(-1);
+	fwhClose(bus);
+}
+
+//Nothing known about the chip carries over to the next batch: a swapped chip fails verification, and it comes up
+//write-locked again, so its locks have to be cleared again before programming
+static void testChipSwap(void)
+{
+	static unsigned char image[0x200];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 5);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10000, 0x100, image) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_OK);
+	simMemory()[0x10080] ^= 0x10;
+	for (unsigned int i = 0; i < SIM_BLOCKS; i++) simSetLock(i, FWH_LOCK_WRITE);
+	CHECK(fwhSubmit(bus, FWH_OP_VERIFY, 0x10000, 0x100, image) == FWH_OK);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10100, 0x100, image + 0x100) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_ERR_VERIFY);
+	CHECK(fwhResults(bus, &ops) == 2);
+	CHECK(ops[0].Result == FWH_ERR_VERIFY);
+	CHECK(ops[0].FailAddress == 0x10080);
+	CHECK(ops[1].Result == FWH_OK);
+	CHECK(memcmp(simMemory() + 0x10100, image + 0x100, 0x100) == 0);
+	fwhClose(bus);
+}
+
+//Programming reads the chip (before and while programming), so a read-locked block is unlocked for it as well
+static void testReadLock(void)
+{
+	static unsigned char image[0x100];
+	const FwhOperation* ops;
+	FwhBus* bus = openSim();
+	CHECK(bus != NULL);
+	if (bus == NULL) return;
+	fill(image, sizeof(image), 6);
+	simSetLock(1, FWH_LOCK_WRITE | FWH_LOCK_READ);
+	CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x10000, sizeof(image), image) == FWH_OK);
+	CHECK(fwhExecute(bus) == FWH_OK);
+	CHECK(fwhResults(bus, &ops) == 1);
+	CHECK(ops[0].Result == FWH_OK);
+	CHECK(simLock(1) == 0);
+	CHECK(memcmp(simMemory() + 0x10000, image, sizeof(image)) == 0);
+	fwhClose(bus);
+}
+
+int main(void)
+{
+	static const TestCase tests[] =
+	{
+		{ "all ok", testAllOk },
+		{ "partial failure", testPartialFailure },
+		{ "needs erase", testNeedsErase },
+		{ "locked-down block", testLockedDown },
+		{ "chip swap", testChipSwap },
+		{ "read lock", testReadLock }
+	};
+	//Failing backend calls are the host's own, the coprocessor reports those as bus errors
+	static const TestCase localTests[] =
+	{
+		{ "gpio failure", testGpioFailure }
+	};
+	LinkEmuConfig link = { 0 };
+	runTests("local", tests, sizeof(tests) / sizeof(tests[0]));
+	runTests("local", localTests, sizeof(localTests) / sizeof(localTests[0]));
+	remotePort = linkEmuStart(&link);
+	CHECK(remotePort != NULL);
+	if (remotePort != NULL) runTests("coprocessor", tests, sizeof(tests) / sizeof(tests[0]));
+	linkEmuStop();
+	return testResult();
+}
@@ -0,0 +1,171 @@
+/*
+
+	Coprocessor link tests: remote.c against firmware/coproc.c over a pty (linkemu.c), with frames corrupted
+	in either direction.
+
+*/
+
+#include <string.h>
+#include <time.h>
+#include "harness.h"
+#include "../remote.h"
+#include "linkemu.h"
+
+static FwhBus* openRemote(const char* port)
+{
+	FwhConfig config = { .RemotePort = port };
+	return openTestBus(config);
+}
+
+//chipsim.c takes over usleep(), so results still in flight are waited for with nanosleep()
+static void settle(void)
+{
+	struct timespec t = { 0, 200 * 1000 * 1000 };
+	nanosleep(&t, NULL);
+}
+
+static void testClean(void)
+{
+	static unsigned char image[0x3000], data[0x3000];
+	LinkEmuConfig config = { 0 };
+	const char* port = linkEmuStart(&config);
+	CHECK(port != NULL);
+	FwhBus* bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		fill(image, sizeof(image), 1);
+		CHECK(fwhErase(bus, 0x10000, sizeof(image)) == FWH_OK);
+		CHECK(fwhProgram(bus, 0x10000, sizeof(image), image) == FWH_OK);
+		CHECK(fwhRead(bus, 0x10000, sizeof(data), data) == FWH_OK);
+		CHECK(memcmp(image, data, sizeof(data)) == 0);
+		CHECK(fwhVerify(bus, 0x10000, sizeof(image), image) == FWH_OK);
+		fwhClose(bus);
+	}
+	CHECK(linkEmuStats()->Naks == 0);
+	CHECK(linkEmuStats()->Batches == linkEmuStats()->Results);
+	linkEmuStop();
+}
+
+//The coprocessor rejects the batch on its CRC, NAKs once, and the host resends it and everything after it
+static void testCorruptBatch(void)
+{
+	static unsigned char data[0x2000];
+	LinkEmuConfig config = { 0 };
+	const char* port = linkEmuStart(&config);
+	CHECK(port != NULL);
+	FwhBus* bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		//Second batch of the read, the first one is in flight by then
+		linkEmuConfig()->CorruptBatch = linkEmuStats()->Batches + 2;
+		memset(data, 0, sizeof(data));
+		CHECK(fwhRead(bus, 0, sizeof(data), data) == FWH_OK);
+		unsigned int erased = 0;
+		for (unsigned int i = 0; i < sizeof(data); i++) erased += (data[i] == 0xFF);
+		CHECK(erased == sizeof(data));
+		fwhClose(bus);
+	}
+	CHECK(linkEmuStats()->Naks == 1);
+	CHECK(linkEmuStats()->Batches > linkEmuStats()->Results);
+	linkEmuStop();
+}
+
+//No result comes back before REMOTE_WINDOW batches have arrived: the host has to fill the window and then keep refilling it
+static void testWindow(void)
+{
+	static unsigned char data[0x4000];
+	LinkEmuConfig config = { 0 };
+	unsigned int before = 0;
+	const char* port = linkEmuStart(&config);
+	CHECK(port != NULL);
+	FwhBus* bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		//The lock sweep waits for its result, it has to be done (and cached) before results are held back
+		const unsigned char* locks;
+		unsigned int count;
+		CHECK(fwhReadLocks(bus, &locks, &count) == FWH_OK);
+		before = linkEmuStats()->Results;
+		linkEmuConfig()->HoldResults = before + REMOTE_WINDOW;
+		CHECK(fwhRead(bus, 0, sizeof(data), data) == FWH_OK);
+		fwhClose(bus);
+	}
+	CHECK(linkEmuStats()->Results - before > 2 * REMOTE_WINDOW);
+	CHECK(linkEmuStats()->Naks == 0);
+	linkEmuStop();
+}
+
+//A result can't be asked for again, so a corrupted one fails the operation; the next session starts clean
+static void testCorruptResult(void)
+{
+	static unsigned char data[0x2000];
+	LinkEmuConfig config = { 0 };
+	const char* port = linkEmuStart(&config);
+	CHECK(port != NULL);
+	FwhBus* bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		linkEmuConfig()->CorruptResult = linkEmuStats()->Results + 2;
+		CHECK(fwhRead(bus, 0, sizeof(data), data) == FWH_ERR_LINK);
+		CHECK(strstr(remoteError(), "corrupted") != NULL);
+		fwhClose(bus);
+	}
+	settle();
+	bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		CHECK(fwhRead(bus, 0, sizeof(data), data) == FWH_OK);
+		fwhClose(bus);
+	}
+	linkEmuStop();
+}
+
+//A command failing on the bus is that operation's error at the chip address, the link and the session go on
+static void testCommandFailure(void)
+{
+	static unsigned char data[0x100];
+	const unsigned char zero = 0x00, value = 0x12;
+	const FwhOperation* ops;
+	LinkEmuConfig config = { 0 };
+	const char* port = linkEmuStart(&config);
+	CHECK(port != NULL);
+	FwhBus* bus = openRemote(port);
+	CHECK(bus != NULL);
+	if (bus != NULL)
+	{
+		CHECK(fwhProgram(bus, 0x10000, 1, &zero) == FWH_OK);
+		//Cleared bits don't come back without an erase, so data# polling reports the byte
+		CHECK(fwhProgram(bus, 0x10000, 1, &value) == FWH_ERR_VERIFY);
+		CHECK(strstr(logged, "at address 00010000") != NULL);
+		CHECK(fwhRead(bus, 0x10000, sizeof(data), data) == FWH_OK);
+		CHECK(data[0] == 0x00 && data[1] == 0xFF);
+		fill(data, sizeof(data), 2);
+		CHECK(fwhSubmit(bus, FWH_OP_PROGRAM, 0x20000, sizeof(data), data) == FWH_OK);
+		CHECK(fwhSubmit(bus, FWH_OP_VERIFY, 0x20000, sizeof(data), data) == FWH_OK);
+		CHECK(fwhExecute(bus) == FWH_OK);
+		CHECK(fwhResults(bus, &ops) == 2);
+		CHECK(ops[0].Result == FWH_OK && ops[1].Result == FWH_OK);
+		fwhClose(bus);
+	}
+	CHECK(linkEmuStats()->Naks == 0);
+	linkEmuStop();
+}
+
+int main(void)
+{
+	static const TestCase tests[] =
+	{
+		{ "clean link", testClean },
+		{ "corrupted batch", testCorruptBatch },
+		{ "window refill", testWindow },
+		{ "corrupted result", testCorruptResult },
+		{ "command failure", testCommandFailure }
+	};
+	runTests(NULL, tests, sizeof(tests) / sizeof(tests[0]));
+	return testResult();
+}
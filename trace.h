@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+
+	Bus trace format, shared by the capture code (lpc.c) and the offline decoder (fwhtrace.c).
+	File layout: TraceHeader followed by Count TraceEntry records in chronological order (host byte order).
+
+*/
+
+#include <stdint.h>
+#if !defined(__aarch64__) && !defined(__x86_64__) && !defined(__i386__)
+#include <time.h>
+#endif
+#if defined(__arm__) && (__ARM_ARCH >= 7)
+#include <sys/auxv.h>
+#ifndef HWCAP_EVTSTRM
+#define HWCAP_EVTSTRM (1 << 21)
+#endif
+#endif
+
+#define TRACE_MAGIC "FWHT"
+#define TRACE_VERSION 1u
+#define TRACE_RING_LEN (1u << 20) //Entries, has to be a power of 2 (16 MiB, ~50k single-byte cycles)
+
+#define TRACE_OUT 0x01u //Host drove LAD (otherwise it was sampled)
+#define TRACE_LFRAME 0x02u //LFRAME was asserted (low)
+
+typedef struct
+{
+	uint64_t Time; //Free-running counter ticks, see TraceHeader.TicksPerSecond
+	uint8_t Nibble;
+	uint8_t Flags;
+} TraceEntry;
+
+typedef struct
+{
+	char Magic[4];
+	uint32_t Version;
+	double TicksPerSecond;
+	uint32_t Count;
+	uint32_t Dropped; //Older entries overwritten by the ring (saturates)
+} TraceHeader;
+
+//Cheapest monotonic counter available from userspace: a single instruction on the Pi (CNTVCT, 64-bit and 32-bit
+//kernels alike) and x86. Elsewhere clock_gettime() (vDSO), which costs some tens of ns per nibble.
+static inline uint64_t traceTicks(void)
+{
+#if defined(__aarch64__)
+	uint64_t t;
+	__asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+	return t;
+#elif defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+#if defined(__arm__) && (__ARM_ARCH >= 7)
+	//ARMv7 cores with the generic timer (Pi 2 and later) let userspace read CNTVCT if the kernel enables it,
+	//which the timer event stream hwcap tells. Cortex-A8/A9 have no generic timer and fall through.
+	static int counter = -1;
+	if (counter < 0) counter = (getauxval(AT_HWCAP) & HWCAP_EVTSTRM) != 0;
+	if (counter)
+	{
+		uint64_t t;
+		__asm__ __volatile__ ("mrrc p15, 1, %Q0, %R0, c14" : "=r" (t));
+		return t;
+	}
+#endif
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#endif